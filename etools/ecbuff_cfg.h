@@ -116,6 +116,6 @@
  * This exposes the element's memory for direct access by peripherals or DMA,
  * enabling true zero-copy operation.
  */
-//#define ECB_DIRECT_ACCESS
+#define ECB_DIRECT_ACCESS
 
 #endif /* ECBUFF_CFG_H */
@@ -0,0 +1,140 @@
+/* Flash-backed config store
+ *
+ * (c) fenugrec 2018-2021
+ * GPLv3
+ *
+ * Page layout : 16-bit page status, 16-bit pad, then 4-byte records.
+ * Record : value (half-word at +0), then key | (crc8 << 8) (half-word at +2).
+ * The value is programmed first, so a record torn by a reset has a bad key / crc
+ * and is skipped. Erased records (all 1s) mark the end of the log.
+ *
+ * Page status and transfers are handled by flash_pair.c.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cfg_store.h"
+#include "firmware.h"
+#include "flash_pair.h"
+#include "hw_backend.h"
+
+#include "stypes.h"
+
+
+#define REC_SIZE	4
+#define REC_EMPTY	0xFFFFFFFF
+
+static struct {
+	uint16_t val[CFG_NKEYS];
+	uint16_t present;   //bitmask of keys that have a record
+	struct flash_pair fp;
+	uint32_t wpos;      //address of next free record
+} cfgs = {
+	.fp = {CFG_BASE, CFG_PAGESIZE, 0},
+};
+
+
+/** CRC-8 (poly 0x07) of key and value */
+static uint8_t rec_crc(uint8_t key, uint16_t val) {
+	u8 buf[3] = {key, val & 0xFF, val >> 8};
+	u8 crc = 0xFF;
+	unsigned i, bit;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		crc ^= buf[i];
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x80) ? (u8) ((crc << 1) ^ 0x07) : (u8) (crc << 1);
+		}
+	}
+	return crc;
+}
+
+static enum errcodes program16(uint32_t addr, uint16_t data) {
+	return flash_prog16(addr, data);
+}
+
+/** load all valid records of the active page into the RAM copy; set write position */
+static void scan_page(void) {
+	u32 addr;
+
+	cfgs.present = 0;
+	for (addr = FPAIR_START(&cfgs.fp); addr < FPAIR_END(&cfgs.fp); addr += REC_SIZE) {
+		u32 rec = FLASH32(addr);
+		if (rec == REC_EMPTY) {
+			break;
+		}
+		u16 val = rec & 0xFFFF;
+		u8 key = (rec >> 16) & 0xFF;
+		if ((key < CFG_NKEYS) && (((rec >> 24) & 0xFF) == rec_crc(key, val))) {
+			cfgs.val[key] = val;
+			cfgs.present |= 1U << key;
+		}
+	}
+	cfgs.wpos = addr;
+}
+
+static enum errcodes append_rec(uint8_t key, uint16_t val) {
+	enum errcodes rv;
+
+	rv = program16(cfgs.wpos, val);
+	if (rv == E_OK) {
+		rv = program16(cfgs.wpos + 2, key | (rec_crc(key, val) << 8));
+	}
+	// skip the slot even if it failed
+	cfgs.wpos += REC_SIZE;
+	return rv;
+}
+
+/** copy current values to the other page, and make it active */
+static enum errcodes transfer(void) {
+	unsigned key;
+
+	cfgs.wpos = fpair_xfer_begin(&cfgs.fp);
+	if (!cfgs.wpos) {
+		goto fail;
+	}
+	for (key = 0; key < CFG_NKEYS; key++) {
+		if (!(cfgs.present & (1U << key))) continue;
+		if (append_rec(key, cfgs.val[key])) {
+			goto fail;
+		}
+	}
+	if (fpair_xfer_end(&cfgs.fp)) {
+		goto fail;
+	}
+	return E_OK;
+
+fail:
+	// RAM copy is up to date; retry on next write
+	cfgs.wpos = FPAIR_END(&cfgs.fp);
+	return E_FIFO;
+}
+
+void cfg_store_init(void) {
+	fpair_init(&cfgs.fp);
+	scan_page();
+}
+
+uint16_t cfg_read(uint8_t key) {
+	if (key >= CFG_NKEYS) {
+		return 0;
+	}
+	return cfgs.val[key];
+}
+
+enum errcodes cfg_write(uint8_t key, uint16_t val) {
+	if (key >= CFG_NKEYS) {
+		return E_FIFO;
+	}
+	if ((cfgs.present & (1U << key)) && (cfgs.val[key] == val)) {
+		return E_OK;
+	}
+	cfgs.val[key] = val;
+	cfgs.present |= 1U << key;
+	if (cfgs.wpos >= FPAIR_END(&cfgs.fp)) {
+		// page full : the new value goes along with the others
+		return transfer();
+	}
+	return append_rec(key, val);
+}
@@ -0,0 +1,42 @@
+#ifndef _CFG_STORE_H
+#define _CFG_STORE_H
+
+/*
+ * Persistent config store, "EEPROM emulation" style (see ST AN2594)
+ *
+ * (c) fenugrec 2018-2021
+ * GPLv3
+ *
+ * Values are appended as small CRC-protected records to one of two flash pages
+ * at the end of flash. When the active page is full, the latest value of each key
+ * is copied to the other page, which becomes active; this spreads erase cycles.
+ * A RAM copy of all values is built once at boot, so reads never touch flash.
+ */
+
+#include <stdint.h>
+
+#include "firmware.h"
+
+/* Last two pages of flash; the linker script must keep code out of there.
+ * F070x6 has 1kB pages. Parts with 2kB pages (F070xB) need CFG_PAGESIZE 2048.
+ */
+#define CFG_PAGESIZE	1024
+#define CFG_BASE	(0x08000000 + (32 * 1024) - (2 * CFG_PAGESIZE))
+
+#define CFG_NKEYS	16	//valid keys : 0 to CFG_NKEYS - 1
+
+
+/** find active page and load all values. Must be called before cfg_read() / cfg_write() */
+void cfg_store_init(void);
+
+/** get value
+ * @return last value written, 0 if never written
+ */
+uint16_t cfg_read(uint8_t key);
+
+/** save value. Nothing is written to flash if the value didn't change
+ * @return E_OK, or E_FIFO if the key is invalid or flash programming failed
+ */
+enum errcodes cfg_write(uint8_t key, uint16_t val);
+
+#endif // _CFG_STORE_H
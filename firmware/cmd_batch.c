@@ -0,0 +1,63 @@
+/* Command line batches
+ *
+ * (c) fenugrec 2018-2021
+ * GPLv3
+ *
+ * Kept apart from cmd_parser.c so the host tests can use it as is.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "cmd_batch.h"
+
+
+char *find_cmdsep(char *line, unsigned len) {
+	unsigned i;
+
+	for (i = 0; (i + 2) < len; i++) {
+		if (line[i] == CMD_ESC) {
+			i++;
+			continue;
+		}
+		if ((line[i] == ';') && (line[i + 1] == '+') && (line[i + 2] == '+')) {
+			return &line[i];
+		}
+	}
+	return NULL;
+}
+
+unsigned cmd_unescape(char *cmd, unsigned len) {
+	char *esc = memchr(cmd, CMD_ESC, len);
+	unsigned o;
+	unsigned i;
+
+	if (!esc) {
+		cmd[len] = 0;
+		return len;
+	}
+	for (i = o = esc - cmd; i < len; i++) {
+		if ((cmd[i] == CMD_ESC) && ((i + 1) < len)) {
+			i++;
+		}
+		cmd[o++] = cmd[i];
+	}
+	cmd[o] = 0;
+	return o;
+}
+
+unsigned cmd_split(char **line, unsigned *len) {
+	char *cmd = *line;
+	char *sep = find_cmdsep(cmd, *len);
+	unsigned clen = *len;
+
+	if (sep) {
+		clen = sep - cmd;
+		*len -= clen + 1;
+		*line = sep + 1;
+	} else {
+		*len = 0;
+		*line = NULL;
+	}
+	return cmd_unescape(cmd, clen);
+}
@@ -0,0 +1,37 @@
+#ifndef _CMD_BATCH_H
+#define _CMD_BATCH_H
+
+/*
+ * Command line batches, like "++addr 5;++eos 3;++read eoi"
+ *
+ * (c) fenugrec 2018-2021
+ * GPLv3
+ *
+ * Commands are only split on ";++", since ';' is common inside instrument
+ * commands. An escaped ';' never splits : for command lines, the input filter
+ * keeps the Escape in front of ';' and Escape (see host_comms.c), and
+ * cmd_unescape() strips it once the line is split.
+ */
+
+#define CMD_ESC	27
+
+/** find ";++" command separator, skipping escaped bytes
+ * @return position of ';', or NULL
+ */
+char *find_cmdsep(char *line, unsigned len);
+
+/** strip escapes in-place, and 0-terminate
+ * @return new length
+ */
+unsigned cmd_unescape(char *cmd, unsigned len);
+
+/** split the next command off a batch, in-place
+ *
+ * @param line : remaining line, command at the start. Set to the next command,
+ * or to NULL after the last one.
+ * @param len : length of the remaining line, updated
+ * @return length of the command, now unescaped and 0-terminated at the old *line
+ */
+unsigned cmd_split(char **line, unsigned *len);
+
+#endif // _CMD_BATCH_H
@@ -1,6 +1,6 @@
 /* ANSI-C code produced by gperf version 3.1 */
 /* Command-line: gperf -T -m 4 --output-file cmd_hashtable.c cmd_hashtable.gen  */
-/* Computed positions: -k'3,$' */
+/* Computed positions: -k'3-4,$' */
 
 #if !((' ' == 32) && ('!' == 33) && ('"' == 34) && ('#' == 35) \
       && ('%' == 37) && ('&' == 38) && ('\'' == 39) && ('(' == 40) \
@@ -40,12 +40,12 @@
 // silly warning for missing prototype
 const struct cmd_entry *cmd_lookup (register const char *str, register size_t len);
 
-#define TOTAL_KEYWORDS 25
+#define TOTAL_KEYWORDS 42
 #define MIN_WORD_LENGTH 5
 #define MAX_WORD_LENGTH 13
-#define MIN_HASH_VALUE 5
-#define MAX_HASH_VALUE 29
-/* maximum key range = 25, duplicates = 0 */
+#define MIN_HASH_VALUE 16
+#define MAX_HASH_VALUE 127
+/* maximum key range = 112, duplicates = 0 */
 
 #ifdef __GNUC__
 __inline
@@ -59,91 +59,173 @@ cmd_hash (register const char *str, register size_t len)
 {
   static const unsigned char asso_values[] =
     {
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 14, 30,  1,
-      12,  0, 30,  2,  5, 11, 30, 30,  8, 22,
-      14,  6, 18, 19,  0,  0,  2,  6, 17, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
-      30, 30, 30, 30, 30, 30
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128,  32,   1,  29,
+       26,  37,  33,  11,  24,  41, 128, 128,  16,  47,
+       18,   0,   9,   8,  49,   2,   4,   3,  25,   7,
+      128,   0, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+      128, 128, 128, 128, 128, 128
     };
-  return len + asso_values[(unsigned char)str[2]] + asso_values[(unsigned char)str[len - 1]];
+  return len + asso_values[(unsigned char)str[3]] + asso_values[(unsigned char)str[2]] + asso_values[(unsigned char)str[len - 1]];
 }
 
 static const struct cmd_entry wordlist[] =
   {
     {"",do_nothing,""}, {"",do_nothing,""},
     {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+#line 48 "cmd_hashtable.gen"
+    {"++status", do_status, "specify SPOLL byte"},
+    {"",do_nothing,""},
+#line 65 "cmd_hashtable.gen"
+    {"++query", do_query, "<PAD> <text> : write, then read reply. Counted output"},
+    {"",do_nothing,""},
+#line 67 "cmd_hashtable.gen"
+    {"++tseq", do_tseq, "<period_us> <count> <read:0|1> <PAD> [<SAD>] ... : timed GET sequence"},
+    {"",do_nothing,""},
+#line 26 "cmd_hashtable.gen"
+    {"++strip", do_strip, ""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""},
+#line 46 "cmd_hashtable.gen"
+    {"++spoll", do_spoll, "[<PAD> [<SAD>]]"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+#line 38 "cmd_hashtable.gen"
+    {"++llo", do_llo, "[<PADn> [<SADn>] ...] set lockout"},
     {"",do_nothing,""},
+#line 40 "cmd_hashtable.gen"
+    {"++lon", do_lon, "[0|1] listen-only (all addresses)"},
+    {"",do_nothing,""},
+#line 31 "cmd_hashtable.gen"
+    {"++auto", do_autoRead, "[0|1|2|3] read after write. 2: only after queries, 3: queries or MAV"},
+    {"",do_nothing,""}, {"",do_nothing,""},
 #line 34 "cmd_hashtable.gen"
     {"++eos", do_eos2, "GPIB termination char to append. 0: CRLF, 1: CR, 2: LF, 3:none"},
-#line 32 "cmd_hashtable.gen"
-    {"++clr", do_clr, "send SDC"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""},
+#line 39 "cmd_hashtable.gen"
+    {"++loc", do_loc, "[<PADn> [<SADn>] ...] set local"},
+    {"",do_nothing,""},
+#line 57 "cmd_hashtable.gen"
+    {"++tag", do_tag, "[<0-255> <command or data>] : tagged reply, for pipelining. No args: queue depth"},
+    {"",do_nothing,""},
+#line 45 "cmd_hashtable.gen"
+    {"++savecfg", do_savecfg, ""},
+#line 68 "cmd_hashtable.gen"
+    {"++scan", do_scan, "[<interval_ms> <PAD> <text>[|<PAD> <text>...]] : periodic scan. 0: stop"},
+#line 58 "cmd_hashtable.gen"
+    {"++waitsrq", do_waitsrq, "[timeout_ms] wait for SRQ"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""},
 #line 44 "cmd_hashtable.gen"
     {"++rst", do_reset, ""},
-#line 48 "cmd_hashtable.gen"
-    {"++status", do_status, "specify SPOLL byte"},
-#line 49 "cmd_hashtable.gen"
+    {"",do_nothing,""}, {"",do_nothing,""},
+#line 66 "cmd_hashtable.gen"
+    {"++mquery", do_mquery, "<PAD> <text>[|<PAD> <text>...] : pipelined queries"},
+#line 47 "cmd_hashtable.gen"
+    {"++srq", do_srq, "query SRQ signal"},
+#line 64 "cmd_hashtable.gen"
+    {"++bin", do_binmode, "enter binary framed mode"},
+    {"",do_nothing,""},
+#line 28 "cmd_hashtable.gen"
+    {"++dfu", do_reset_dfu, ""},
+    {"",do_nothing,""},
+#line 52 "cmd_hashtable.gen"
     {"++trg", do_trg, "[<PADn> [<SADn>] ...] send GET"},
-#line 36 "cmd_hashtable.gen"
-    {"++eot_char", do_eotChar, "<char_decimal>. USB termination char"},
-#line 45 "cmd_hashtable.gen"
-    {"++savecfg", do_savecfg, ""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""},
+#line 55 "cmd_hashtable.gen"
+    {"++abort_ifc", do_abort_ifc, "[0|1] pulse IFC on USB break / DTR drop"},
+#line 61 "cmd_hashtable.gen"
+    {"++mlist", do_mlist, "list macros"},
+#line 60 "cmd_hashtable.gen"
+    {"++run", do_run, "<name> [<arg1> ...] : run macro; $1..$9 are replaced by args"},
+#line 54 "cmd_hashtable.gen"
+    {"++help", do_help, ""},
+#line 49 "cmd_hashtable.gen"
+    {"++devq", do_devq, "[clr] device mode: queued output (messages,free bytes)"},
+#line 63 "cmd_hashtable.gen"
+    {"++cfg", do_cfg, "[<hex>] dump / apply all settings"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+#line 27 "cmd_hashtable.gen"
+    {"++debug", do_debug, "[0|1] enable debug output"},
+    {"",do_nothing,""},
+#line 33 "cmd_hashtable.gen"
+    {"++eoi", do_eoi, "[0|1] assert EOI with last char"},
+    {"",do_nothing,""}, {"",do_nothing,""},
 #line 35 "cmd_hashtable.gen"
     {"++eot_enable", do_eotEnable, ""},
+#line 50 "cmd_hashtable.gen"
+    {"++devsel", do_devsel, "[<PAD> [<SAD>]] device mode: target of host data and ++status"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+#line 41 "cmd_hashtable.gen"
+    {"++mode", do_mode, "[0|1] enable Controller mode"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+#line 62 "cmd_hashtable.gen"
+    {"++mdel", do_mdel, "<name>|* : delete macro(s)"},
+#line 36 "cmd_hashtable.gen"
+    {"++eot_char", do_eotChar, "<char_decimal>. USB termination char"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+#line 32 "cmd_hashtable.gen"
+    {"++clr", do_clr, "[<PADn> [<SADn>] ...] send SDC"},
+#line 51 "cmd_hashtable.gen"
+    {"++dcache", do_dcache, "[<query>|<response>] device mode: answer query locally. Empty response: delete, *: clear"},
 #line 43 "cmd_hashtable.gen"
     {"++read_tmo_ms", do_readTimeout, "inter-char timeout"},
-#line 39 "cmd_hashtable.gen"
-    {"++loc", do_loc, "set local"},
-#line 46 "cmd_hashtable.gen"
-    {"++spoll", do_spoll, "[<PAD> [<SAD>]]"},
-#line 33 "cmd_hashtable.gen"
-    {"++eoi", do_eoi, "[0|1] assert EOI with last char"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
 #line 37 "cmd_hashtable.gen"
     {"++ifc", do_ifc, ""},
-#line 42 "cmd_hashtable.gen"
-    {"++read", do_readCmd2, "[eoi|<char_decimal>]"},
-#line 38 "cmd_hashtable.gen"
-    {"++llo", do_llo, "set lockout"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""},
+#line 59 "cmd_hashtable.gen"
+    {"++mdef", do_mdef, "<name> : record following lines as macro, until ++mend"},
 #line 30 "cmd_hashtable.gen"
-    {"++addr", do_addr, ""},
-#line 27 "cmd_hashtable.gen"
-    {"++debug", do_debug, "[0|1] enable debug output"},
-#line 50 "cmd_hashtable.gen"
+    {"++addr", do_addr, "[<PADn> [<SADn>] ...] set target devices"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+#line 53 "cmd_hashtable.gen"
     {"++ver", do_version2, ""},
-#line 28 "cmd_hashtable.gen"
-    {"++dfu", do_reset_dfu, ""},
-#line 47 "cmd_hashtable.gen"
-    {"++srq", do_srq, "query SRQ signal"},
-#line 26 "cmd_hashtable.gen"
-    {"++strip", do_strip, ""},
-#line 31 "cmd_hashtable.gen"
-    {"++auto", do_autoRead, ""},
-#line 40 "cmd_hashtable.gen"
-    {"++lon", do_lon, "[0|1] listen-only (all addresses)"},
-#line 41 "cmd_hashtable.gen"
-    {"++mode", do_mode, "[0|1] enable Controller mode"},
-#line 51 "cmd_hashtable.gen"
-    {"++help", do_help, ""}
+    {"",do_nothing,""},
+#line 42 "cmd_hashtable.gen"
+    {"++read", do_readCmd2, "[eoi|<char_decimal>]"},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+    {"",do_nothing,""}, {"",do_nothing,""},
+#line 56 "cmd_hashtable.gen"
+    {"++rframe", do_rframe, "[0|1] counted read replies, ending with termination status"}
   };
 
 const struct cmd_entry *
@@ -163,16 +245,17 @@ cmd_lookup (register const char *str, register size_t len)
     }
   return 0;
 }
-#line 52 "cmd_hashtable.gen"
+#line 69 "cmd_hashtable.gen"
 
-void cmd_find_run(const char *cmdstr, unsigned cmdlen, const char *args) {
+bool cmd_find_run(const char *cmdstr, unsigned cmdlen, const char *args) {
 	const struct cmd_entry *cmd;
 
 	cmd = cmd_lookup(cmdstr, cmdlen);
 	if (cmd == NULL) {
-		return;
+		return 0;
 	}
 	cmd->handler(args);
+	return 1;
 }
 
 #define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
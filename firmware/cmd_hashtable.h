@@ -1,13 +1,16 @@
 #ifndef _CMD_HASHTABLE_H
 #define _CMD_HASHTABLE_H
 
+#include <stdbool.h>
+
 /** find and run the command handler
  *
  * @param cmdstr the command token such as "++addr", 0-terminated
  * @param cmdlen strlen(cmdstr) ?
  * @param args start of arguments after command token, 0-terminated
+ * @return 0 if command not found
  */
-void cmd_find_run(const char *cmdstr, unsigned cmdlen, const char *args);
+bool cmd_find_run(const char *cmdstr, unsigned cmdlen, const char *args);
 
 struct cmd_entry {
 	const char *name;
@@ -39,18 +39,23 @@
 #include "libc_stubs.h"
 #include "hw_conf.h"
 #include "cmd_parser.h"
+#include "cmd_batch.h"
 #include "firmware.h"
 #include "gpib.h"
 #include "host_comms.h"
 #include "ecbuff.h"
 #include "hw_backend.h"
+#include "cfg_store.h"
+#include "macro_store.h"
 #include "cmd_hashtable.h"
 #include "cmd_handlers.h"
+#include "usb_cdc.h"
 
 #include "stypes.h"
+#include "utils.h"
 
 
-#define VALID_EEPROM_CODE 0xAA
+#define VALID_CFG_CODE 0xAA
 #define MAX_TIMEOUT		  10*1000 //10 seconds, is there any reason to allow more than this
 
 #define VERSION 5
@@ -59,10 +64,69 @@ char eos_string[3] = "";
 unsigned eos_len = 0;
 bool strip = 0;
 bool listen_only = 0;
+bool abort_ifc = 0;	//pulse IFC on host break
+bool rframe = 0;	//send reads as counted replies
 bool save_cfg = 1;
 
 u8 status_byte = 0;
 
+/** devices set with ++addr. Data writes and addressed commands go to all of them,
+ * reads use the first one (also kept in gpib_cfg.partnerAddress) */
+static struct gpib_addrlist addr_group = {0};
+
+/** device mode output : messages written by the host, stored back to back.
+ * A device's first message is sent (EOI on its last byte) as soon as it's addressed to talk. */
+#define DEVQ_SIZE	256
+#define DEVQ_MSGS	8
+static struct {
+	u8 buf[DEVQ_SIZE];
+	u16 len[DEVQ_MSGS];
+	u8 dev[DEVQ_MSGS];  //index in addr_group
+	unsigned nmsg;
+	unsigned used;  //bytes in buf
+} devq = {0};
+
+/** device mode : we answer to every address of the ++addr group. Per-device
+ * state is indexed like addr_group; gpib_cfg.device_talk / device_listen
+ * tell if any of them is addressed. */
+static struct {
+	u8 stb[GPIB_MAXLISTENERS];
+	u16 listen; //bitmask
+	int talker; //-1 if none
+	int pending_pad;    //primary address waiting for its SAD, -1 if none
+	bool pending_talk;
+	unsigned sel;   //++devsel : target of host data and ++status
+} demu = {0};
+
+/** device mode response cache : "<query>\0<response>\0" entries, back to back.
+ * Queries from the controller that match are answered right away through devq. */
+#define DCACHE_SIZE	192
+#define DCACHE_MSGMAX	32  //longer messages are never matched
+static struct {
+	char buf[DCACHE_SIZE];
+	unsigned used;
+} dcache = {0};
+
+/** start of the message being received from the controller */
+static struct {
+	u8 buf[DCACHE_MSGMAX];
+	unsigned len;
+} devmsg = {0};
+
+/** per-address settings. The active values stay in gpib_cfg; they are stored
+ * in the table when ++addr moves away from an address, and reloaded when it comes back.
+ * Addresses never selected before start with the current settings. */
+struct addr_profile {
+	uint16_t timeout;   //ms, <= MAX_TIMEOUT
+	char eot_char;
+	uint8_t eos_code:3;
+	uint8_t eoi:1;
+	uint8_t autoread:2;
+	uint8_t eot_enable:1;
+	uint8_t valid:1;
+};
+static struct addr_profile profiles[31] = {0};
+
 static void set_eos(enum eos_codes newcode) {
 	gpib_cfg.eos_code = newcode;
 	switch (newcode) {
@@ -89,42 +153,182 @@ static void set_eos(enum eos_codes newcode) {
 	}
 }
 
+static void profile_save(unsigned addr) {
+	struct addr_profile *prof = &profiles[addr];
+
+	prof->timeout = gpib_cfg.timeout;
+	prof->eot_char = gpib_cfg.eot_char;
+	prof->eos_code = gpib_cfg.eos_code;
+	prof->eoi = gpib_cfg.eoiUse;
+	prof->autoread = gpib_cfg.autoread;
+	prof->eot_enable = gpib_cfg.eot_enable;
+	prof->valid = 1;
+}
+
+static void profile_load(unsigned addr) {
+	const struct addr_profile *prof = &profiles[addr];
+
+	if (!prof->valid) {
+		return;
+	}
+	gpib_cfg.timeout = prof->timeout;
+	gpib_cfg.eot_char = prof->eot_char;
+	set_eos(prof->eos_code);
+	gpib_cfg.eoiUse = prof->eoi;
+	gpib_cfg.autoread = prof->autoread;
+	gpib_cfg.eot_enable = prof->eot_enable;
+}
+
 static bool srq_state(void) {
 	return !((bool)gpio_get(HCTRL2_CP, SRQ));
 }
 
 
+static void demu_reset(void);	//fwd decl
+
 void cmd_parser_init(void) {
-	// Handle the EEPROM stuff
-	if (read_eeprom(0x00) == VALID_EEPROM_CODE) {
-		gpib_cfg.controller_mode = read_eeprom(0x01);
-		gpib_cfg.partnerAddress = read_eeprom(0x02);
-		gpib_cfg.eot_char = read_eeprom(0x03);
-		gpib_cfg.eot_enable = read_eeprom(0x04);
-		gpib_cfg.eos_code = read_eeprom(0x05);
+	// load saved config
+	if (cfg_read(0x00) == VALID_CFG_CODE) {
+		gpib_cfg.controller_mode = cfg_read(0x01);
+		gpib_cfg.partnerAddress = cfg_read(0x02);
+		gpib_cfg.eot_char = cfg_read(0x03);
+		gpib_cfg.eot_enable = cfg_read(0x04);
+		gpib_cfg.eos_code = cfg_read(0x05);
 		set_eos(gpib_cfg.eos_code);
-		gpib_cfg.eoiUse = read_eeprom(0x06);
-		gpib_cfg.autoread = read_eeprom(0x07);
-		listen_only = read_eeprom(0x08);
-		save_cfg = read_eeprom(0x09);
+		gpib_cfg.eoiUse = cfg_read(0x06);
+		gpib_cfg.autoread = cfg_read(0x07);
+		listen_only = cfg_read(0x08);
+		save_cfg = cfg_read(0x09);
+		gpib_cfg.timeout = cfg_read(0x0A);
 	} else {
-		write_eeprom(0x00, VALID_EEPROM_CODE);
-		write_eeprom(0x01, 1); // mode
-		write_eeprom(0x02, 1); // partnerAddress
-		write_eeprom(0x03, 13); // eot_char
-		write_eeprom(0x04, 1); // eot_enable
-		write_eeprom(0x05, EOS_NUL); // eos_code
-		write_eeprom(0x06, 1); // eoiUse
-		write_eeprom(0x07, 1); // autoread
-		write_eeprom(0x08, 0); // listen_only
-		write_eeprom(0x09, 1); // save_cfg
+		// first boot : save the built-in defaults we're running with
+		cfg_write(0x00, VALID_CFG_CODE);
+		cfg_write(0x01, gpib_cfg.controller_mode);
+		cfg_write(0x02, gpib_cfg.partnerAddress);
+		cfg_write(0x03, gpib_cfg.eot_char);
+		cfg_write(0x04, gpib_cfg.eot_enable);
+		cfg_write(0x05, gpib_cfg.eos_code);
+		cfg_write(0x06, gpib_cfg.eoiUse);
+		cfg_write(0x07, gpib_cfg.autoread);
+		cfg_write(0x08, listen_only);
+		cfg_write(0x09, save_cfg);
+		cfg_write(0x0A, gpib_cfg.timeout);
 	}
+	addr_group.n = 1;
+	addr_group.pad[0] = gpib_cfg.partnerAddress;
+	demu_reset();
 	if (gpib_cfg.controller_mode) {
 		gpib_controller_assign();
 	}
 
 }
 
+/** skip to next space-separated argument
+ * @return start of next arg, or end of string
+ */
+static const char *next_arg(const char *args) {
+	const char *sp = strchr(args, ' ');
+	if (!sp) {
+		return args + strlen(args);
+	}
+	while (*sp == ' ') {
+		sp++;
+	}
+	return sp;
+}
+
+/** parse address list "<PAD1> [<SAD1>] <PAD2> [<SAD2>] ..."
+ * SADs are given as 96-126, like prologix.
+ * @return 0 if ok
+ */
+static int parse_addrlist(const char *args, struct gpib_addrlist *al) {
+	al->n = 0;
+	while (*args) {
+		int a = atoi(args);
+		if ((a >= CMD_SAD) && (a <= (CMD_SAD + 30)) && al->n && !al->sad[al->n - 1]) {
+			al->sad[al->n - 1] = a;
+		} else if ((a >= 0) && (a <= 30) && (al->n < GPIB_MAXLISTENERS)) {
+			al->pad[al->n] = a;
+			al->sad[al->n] = 0;
+			al->n++;
+		} else {
+			return -1;
+		}
+		args = next_arg(args);
+	}
+	return (al->n == 0);
+}
+
+static void devq_clear(void) {
+	devq.nmsg = 0;
+	devq.used = 0;
+	devmsg.len = 0;
+}
+
+/** SRQ is asserted while any device has RQS set */
+static void update_srq(void) {
+	unsigned i;
+
+	for (i = 0; i < addr_group.n; i++) {
+		if (demu.stb[i] & 0x40) {
+			assert_signal(HCTRL2_CP, SRQ);
+			return;
+		}
+	}
+	unassert_signal(HCTRL2_CP, SRQ);
+}
+
+/** unaddress all devices */
+static void demu_unaddress(void) {
+	demu.listen = 0;
+	demu.talker = -1;
+	demu.pending_pad = -1;
+	gpib_cfg.device_talk = 0;
+	gpib_cfg.device_listen = 0;
+}
+
+static void demu_reset(void) {
+	demu_unaddress();
+	memset(demu.stb, 0, sizeof(demu.stb));
+	demu.sel = 0;
+	devq_clear();
+	if (!gpib_cfg.controller_mode) {
+		update_srq();
+	}
+}
+
+/** set ++addr group; the first device becomes partnerAddress, with its profile */
+static void select_group(const struct gpib_addrlist *al) {
+	// devices to emulate may have changed
+	demu_reset();
+	addr_group = *al;
+	if (gpib_cfg.partnerAddress != al->pad[0]) {
+		// switch eos/eoi/timeout etc. to the new device's
+		profile_save(gpib_cfg.partnerAddress);
+		profile_load(al->pad[0]);
+	}
+	gpib_cfg.partnerAddress = al->pad[0];
+}
+
+/** address a device group as listeners, and send a command byte once
+ * @param args address list, or "" for the ++addr group
+ */
+static enum errcodes group_cmd(const char *args, u8 cmd) {
+	struct gpib_addrlist al;
+	const struct gpib_addrlist *group = &addr_group;
+	enum errcodes rv;
+
+	if (*args) {
+		if (parse_addrlist(args, &al)) {
+			return E_OK;    //ignore bad list, like ++addr
+		}
+		group = &al;
+	}
+	rv = gpib_address_list(group, CTRL_TALK);
+	if (rv) return rv;
+	return gpib_cmd(cmd);
+}
+
 /*** command handlers
  ***
  *** To add / remove commands, cmd_handlers.h and cmd_hashtable.gen
@@ -132,18 +336,23 @@ void cmd_parser_init(void) {
  */
 
 void do_addr(const char *args) {
-	// ++addr N
-	// TODO : addr [pad [sad]] for secondary address too
+	// ++addr <PAD1> [<SAD1>] [<PAD2> [<SAD2>] ...]
+	struct gpib_addrlist al;
 	if (*args == 0) {
-		printf("%i\n", gpib_cfg.partnerAddress);
+		unsigned i;
+		for (i = 0; i < addr_group.n; i++) {
+			printf(i ? " %u" : "%u", addr_group.pad[i]);
+			if (addr_group.sad[i]) {
+				printf(" %u", addr_group.sad[i]);
+			}
+		}
+		printf("\n");
 		return;
 	}
-	int a = atoi(args);
-	if ((a < 0) || (a > 30)) {
+	if (parse_addrlist(args, &al)) {
 		return;
 	}
-	gpib_cfg.partnerAddress = a;
-
+	select_group(&al);
 }
 void do_readTimeout(const char *args) {
 	// ++read_tmo_ms N
@@ -157,19 +366,39 @@ void do_readTimeout(const char *args) {
 	if (temp > MAX_TIMEOUT) temp=MAX_TIMEOUT;
 	gpib_cfg.timeout = temp;
 }
+/** read from bus to host; with ++rframe, as a counted reply that ends with
+ * the termination reason instead of eot_char.
+ */
+static const u8 readend_status[] = {
+	[READEND_EOI] = RS_EOI,
+	[READEND_EOS] = RS_EOS,
+	[READEND_TMO] = RS_TIMEOUT,
+	[READEND_ABORT] = RS_ABORT,
+};
+
+static void host_read(enum gpib_readmode readmode, uint8_t eos_char) {
+	if (!rframe) {
+		gpib_read(readmode, eos_char, gpib_cfg.eot_enable);
+		return;
+	}
+	host_reply_counted();
+	gpib_read(readmode, eos_char, 0);
+	host_reply_end(readend_status[gpib_read_end()]);
+}
+
 void do_readCmd2(const char *args) {
 	// ++read [eoi|<char>]
 	//XXX TODO : err msg when read error occurs
 	if (!gpib_cfg.controller_mode) return;
-	gpib_address_target(gpib_cfg.partnerAddress, DEV_TALK);
+	gpib_address_list(&addr_group, DEV_TALK);
 	if (*args == 0) {
-		gpib_read(GPIBREAD_TMO,0, gpib_cfg.eot_enable); // read until EOS condition
+		host_read(GPIBREAD_TMO, 0); // read until EOS condition
 	} else if (strncmp(args, "eoi", 3) == 0) {
-		gpib_read(GPIBREAD_EOI, 0, gpib_cfg.eot_enable); // read until EOI flagged
+		host_read(GPIBREAD_EOI, 0); // read until EOI flagged
 	} else {
 		// read until specified character
 		u8 tmp_eos = htoi(args);
-		gpib_read(GPIBREAD_EOS, tmp_eos, gpib_cfg.eot_enable);
+		host_read(GPIBREAD_EOS, tmp_eos);
 	}
 }
 void do_eos2(const char *args) {
@@ -177,8 +406,9 @@ void do_eos2(const char *args) {
 	if (*args == 0) {
 		printf("%i\n", gpib_cfg.eos_code);
 	} else {
-		gpib_cfg.eos_code = atoi(args);
-		set_eos(gpib_cfg.eos_code);
+		int code = atoi(args);
+		if ((code < EOS_CRLF) || (code > EOS_NUL)) return;
+		set_eos(code);
 	}
 }
 void do_eoi(const char *args) {
@@ -200,23 +430,19 @@ void do_version2(const char *args) {
 }
 void do_trg(const char *args) {
 	// ++trg [<PAD1> [<SAD1>] <PAD2> [SAD2]  <PAD15> [<SAD15>]]
-	u8 writeError = 0;
-	(void) args;
+	// a single GET reaches all devices at once
 	if (!gpib_cfg.controller_mode) return;
-	if (*args == 0) {
-		writeError = writeError || gpib_address_target(gpib_cfg.partnerAddress, CTRL_TALK);
-		//XXX TODO : do something with writeError
-		gpib_cmd(CMD_GET);
-	} else {
-		//TODO: Add support for specified addresses
-	}
+	//XXX TODO : do something with write error
+	group_cmd(args, CMD_GET);
 }
 void do_autoRead(const char *args) {
 	// ++auto {0|1}
 	if (*args == 0) {
 		printf("%i\n", gpib_cfg.autoread);
 	} else {
-		gpib_cfg.autoread = (bool) atoi(args);
+		int mode = atoi(args);
+		if ((mode < 0) || (mode > AUTOREAD_MAX)) return;
+		gpib_cfg.autoread = mode;
 	}
 }
 void do_reset(const char *args) {
@@ -246,15 +472,12 @@ void do_debug(const char *args) {
 	}
 }
 void do_clr(const char *args) {
-	// ++clr
-	u8 writeError = 0;
-	(void) args;
+	// ++clr [<PAD1> [<SAD1>] ...]
 	if (!gpib_cfg.controller_mode) return;
-	//XXX TODO : do something with writeError
+	//XXX TODO : do something with write error
 	// This command is special in that we must
-	// address a specific instrument.
-	writeError = writeError || gpib_address_target(gpib_cfg.partnerAddress, CTRL_TALK);
-	writeError = writeError || gpib_cmd(CMD_SDC);
+	// address specific instruments.
+	group_cmd(args, CMD_SDC);
 }
 void do_eotEnable(const char *args) {
 	// ++eot_enable {0|1}
@@ -279,23 +502,16 @@ void do_ifc(const char *args) {
 	pulse_ifc();
 }
 void do_llo(const char *args) {
-	// ++llo
-	u8 writeError = 0;
-	(void) args;
-	//XXX TODO : do something with writeError
+	// ++llo [<PAD1> [<SAD1>] ...]
+	//XXX TODO : do something with write error
 	if (!gpib_cfg.controller_mode) return;
-	writeError = writeError || gpib_address_target(gpib_cfg.partnerAddress, CTRL_TALK);
-	writeError = writeError || gpib_cmd(CMD_LLO);
+	group_cmd(args, CMD_LLO);
 }
 void do_loc(const char *args) {
-	// ++loc
-	u8 writeError = 0;
-	(void) args;
-	//XXX TODO : do something with writeError
+	// ++loc [<PAD1> [<SAD1>] ...]
+	//XXX TODO : do something with write error
 	if (!gpib_cfg.controller_mode) return;
-
-	writeError = writeError || gpib_address_target(gpib_cfg.partnerAddress, CTRL_TALK);
-	writeError = writeError || gpib_cmd(CMD_GTL);
+	group_cmd(args, CMD_GTL);
 }
 void do_lon(const char *args) {
 	// ++lon {0|1}
@@ -308,20 +524,189 @@ void do_lon(const char *args) {
 		listen_only = (bool) atoi(args);
 	}
 }
+static void set_mode(bool controller) {
+	gpib_cfg.controller_mode = controller;
+	if (gpib_cfg.controller_mode) {
+		setControls(CINI);
+		gpib_controller_assign();
+	} else {
+		setControls(DINI);
+	}
+}
 void do_mode(const char *args) {
 	// ++mode {0|1}
 	if (*args == 0) {
 		printf("%i\n", gpib_cfg.controller_mode);
 		return;
 	}
-	gpib_cfg.controller_mode = (bool) atoi(args);
-	if (gpib_cfg.controller_mode) {
-		setControls(CINI);
-		gpib_controller_assign();
+	set_mode((bool) atoi(args));
+}
+
+/* ++cfg snapshot, version 2 :
+ * [0] version
+ * [1] flags : CFGF_*
+ * [2] eos_code, [3] eot_char, [4] partnerAddress, [5] myAddress
+ * [6..7] timeout (ms, LE)
+ * [8] autoread mode
+ * [9] checksum : all bytes sum to 0
+ */
+#define CFGBLOB_VER	2
+#define CFGBLOB_LEN	10
+#define CFGF_CONTROLLER	(1 << 0)
+#define CFGF_EOT_ENABLE	(1 << 1)
+#define CFGF_EOI	(1 << 2)
+#define CFGF_AUTOREAD	(1 << 3)    //autoread != AUTOREAD_OFF; mode is in [8]
+#define CFGF_LON	(1 << 4)
+#define CFGF_STRIP	(1 << 5)
+#define CFGF_SAVECFG	(1 << 6)
+#define CFGF_DEBUG	(1 << 7)
+
+static int hexnibble(char c) {
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	return -1;
+}
+
+/** fill blob with current settings */
+static void cfg_snapshot(uint8_t *blob) {
+	u8 sum = 0;
+	unsigned i;
+
+	blob[0] = CFGBLOB_VER;
+	blob[1] = (gpib_cfg.controller_mode ? CFGF_CONTROLLER : 0) |
+		(gpib_cfg.eot_enable ? CFGF_EOT_ENABLE : 0) |
+		(gpib_cfg.eoiUse ? CFGF_EOI : 0) |
+		(gpib_cfg.autoread ? CFGF_AUTOREAD : 0) |
+		(listen_only ? CFGF_LON : 0) |
+		(strip ? CFGF_STRIP : 0) |
+		(save_cfg ? CFGF_SAVECFG : 0) |
+		(gpib_cfg.debug ? CFGF_DEBUG : 0);
+	blob[2] = gpib_cfg.eos_code;
+	blob[3] = gpib_cfg.eot_char;
+	blob[4] = gpib_cfg.partnerAddress;
+	blob[5] = gpib_cfg.myAddress;
+	blob[6] = gpib_cfg.timeout & 0xFF;
+	blob[7] = (gpib_cfg.timeout >> 8) & 0xFF;
+	blob[8] = gpib_cfg.autoread;
+	for (i = 0; i < (CFGBLOB_LEN - 1); i++) {
+		sum += blob[i];
+	}
+	blob[CFGBLOB_LEN - 1] = -sum;
+}
+
+/** validate snapshot. Doesn't touch any state, ok to call from ISR
+ * @return 0 if ok
+ */
+static int cfg_check(const uint8_t *blob) {
+	u8 sum = 0;
+	unsigned i;
+
+	for (i = 0; i < CFGBLOB_LEN; i++) {
+		sum += blob[i];
+	}
+	u32 timeout = blob[6] | (blob[7] << 8);
+	if (sum || (blob[0] != CFGBLOB_VER) ||
+		(blob[2] > EOS_NUL) || (blob[4] > 30) || (blob[5] > 30) ||
+		(timeout > MAX_TIMEOUT) || (blob[8] > AUTOREAD_MAX)) {
+		return -1;
+	}
+	return 0;
+}
+
+/** apply whole snapshot; must have passed cfg_check() */
+static void cfg_apply(const uint8_t *blob) {
+	u8 flags = blob[1];
+	struct gpib_addrlist al = {1, {blob[4]}, {0}};
+
+	select_group(&al);
+	gpib_cfg.myAddress = blob[5];
+	set_eos(blob[2]);
+	gpib_cfg.eot_char = blob[3];
+	gpib_cfg.timeout = blob[6] | (blob[7] << 8);
+	gpib_cfg.eot_enable = !!(flags & CFGF_EOT_ENABLE);
+	gpib_cfg.eoiUse = !!(flags & CFGF_EOI);
+	gpib_cfg.autoread = blob[8];
+	gpib_cfg.debug = !!(flags & CFGF_DEBUG);
+	strip = !!(flags & CFGF_STRIP);
+	save_cfg = !!(flags & CFGF_SAVECFG);
+	listen_only = !!(flags & CFGF_LON) && !(flags & CFGF_CONTROLLER);
+	if (gpib_cfg.controller_mode != !!(flags & CFGF_CONTROLLER)) {
+		set_mode(flags & CFGF_CONTROLLER);
+	}
+}
+
+void do_abort_ifc(const char *args) {
+	// ++abort_ifc {0|1}
+	if (*args == 0) {
+		printf("%i\n", abort_ifc);
 	} else {
-		setControls(DINI);
+		abort_ifc = (bool) atoi(args);
+	}
+}
+
+void do_rframe(const char *args) {
+	// ++rframe {0|1}
+	// 1: reads are sent as "#<status>,<len>\n<data>" segments; last status is
+	// the termination reason (EOI, EOS, timeout, abort).
+	if (*args == 0) {
+		printf("%i\n", rframe);
+	} else {
+		rframe = (bool) atoi(args);
+	}
+}
+
+void do_tag(const char *args) {
+	// ++tag <tag> <command or data>, see chunk_tagged(). Only taken at the start of a line.
+	// Without args : how many requests can be queued ahead.
+	if (*args) {
+		// inside a ";++" batch or a FT_CMD frame : refuse, rather than
+		// leave the host waiting for the tagged reply
+		host_reply_end(RS_EINVAL);
+		return;
+	}
+	printf("%u\n", HOST_IN_CHUNKS - 1);
+}
+
+void do_cfg(const char *args) {
+	// ++cfg [<hex snapshot>]
+	// without args, dump all settings as one hex string; with args, apply them all or nothing.
+	static const char hexdigits[] = "0123456789ABCDEF";
+	u8 blob[CFGBLOB_LEN];
+	unsigned i;
+
+	if (*args == 0) {
+		char hex[(2 * CFGBLOB_LEN) + 1];
+		cfg_snapshot(blob);
+		for (i = 0; i < CFGBLOB_LEN; i++) {
+			hex[2 * i] = hexdigits[blob[i] >> 4];
+			hex[(2 * i) + 1] = hexdigits[blob[i] & 0x0F];
+		}
+		hex[2 * CFGBLOB_LEN] = 0;
+		printf("%s\n", hex);
+		return;
+	}
+
+	if (strlen(args) != (2 * CFGBLOB_LEN)) {
+		goto bad;
+	}
+	for (i = 0; i < CFGBLOB_LEN; i++) {
+		int hi = hexnibble(args[2 * i]);
+		int lo = hexnibble(args[(2 * i) + 1]);
+		if ((hi < 0) || (lo < 0)) {
+			goto bad;
+		}
+		blob[i] = (hi << 4) | lo;
 	}
+	if (cfg_check(blob)) {
+		goto bad;
+	}
+	cfg_apply(blob);
+	return;
+bad:
+	printf("bad cfg\n");
 }
+
 void do_savecfg(const char *args) {
 	// ++savecfg {0|1}
 	if (*args == 0) {
@@ -329,15 +714,16 @@ void do_savecfg(const char *args) {
 	} else {
 		save_cfg = (bool) atoi(args);
 		if (save_cfg) {
-			write_eeprom(0x01, gpib_cfg.controller_mode);
-			write_eeprom(0x02, gpib_cfg.partnerAddress);
-			write_eeprom(0x03, gpib_cfg.eot_char);
-			write_eeprom(0x04, gpib_cfg.eot_enable);
-			write_eeprom(0x05, gpib_cfg.eos_code);
-			write_eeprom(0x06, gpib_cfg.eoiUse);
-			write_eeprom(0x07, gpib_cfg.autoread);
-			write_eeprom(0x08, gpib_cfg.listen_only);
-			write_eeprom(0x09, save_cfg);
+			cfg_write(0x01, gpib_cfg.controller_mode);
+			cfg_write(0x02, gpib_cfg.partnerAddress);
+			cfg_write(0x03, gpib_cfg.eot_char);
+			cfg_write(0x04, gpib_cfg.eot_enable);
+			cfg_write(0x05, gpib_cfg.eos_code);
+			cfg_write(0x06, gpib_cfg.eoiUse);
+			cfg_write(0x07, gpib_cfg.autoread);
+			cfg_write(0x08, listen_only);
+			cfg_write(0x09, save_cfg);
+			cfg_write(0x0A, gpib_cfg.timeout);
 		}
 	}
 }
@@ -347,33 +733,87 @@ void do_srq(const char *args) {
 	if (!gpib_cfg.controller_mode) return;
 	printf("%i\n", srq_state());
 }
+void do_waitsrq(const char *args) {
+	// ++waitsrq [timeout_ms]
+	// wait for SRQ, then print its state like ++srq
+	u32 tmo = gpib_cfg.timeout;
+	if (!gpib_cfg.controller_mode) return;
+	if (*args) {
+		tmo = (u32) atoi(args);
+	}
+	u32 t0 = get_ms();
+	while (!srq_state()) {
+		restart_wdt();
+		if (TS_ELAPSED(get_ms(), t0, tmo) || host_abort_pending()) {
+			break;
+		}
+	}
+	printf("%i\n", srq_state());
+}
 void do_spoll(const char *args) {
 	// ++spoll [pad [sad]]
 	// TODO : support secodnary addr too
 	if (!gpib_cfg.controller_mode) return;
 	if (*args == 0) {
-		if (!gpib_serial_poll(gpib_cfg.partnerAddress, &status_byte)) {
+		if (!gpib_serial_poll(gpib_cfg.partnerAddress, 0, &status_byte)) {
 			printf("%u\n", (unsigned) status_byte);
 		}
 	} else {
-		if (!gpib_serial_poll(atoi(args), &status_byte)) {
+		if (!gpib_serial_poll(atoi(args), 0, &status_byte)) {
 			printf("%u\n", (unsigned) status_byte);
 		}
 	}
 }
+/** set status byte of ++devsel device */
+static void set_status(u8 stb) {
+	// prologix: " If the RQS bit (bit #6) of the status byte is set then the SRQ signal is asserted (low)
+	// After a serial poll, SRQ line is de-asserted and status byte is set to 0 "
+	demu.stb[demu.sel] = stb;
+	update_srq();
+}
 void do_status(const char *args) {
 	// ++status [n]
 	if (gpib_cfg.controller_mode) return;
 	if (*args == 0) {
-		printf("%u\n", (unsigned) status_byte);
+		printf("%u\n", (unsigned) demu.stb[demu.sel]);
 	} else {
-		status_byte = (u8) atoi(args);
-		if (status_byte & 0x40) {
-			// prologix: " If the RQS bit (bit #6) of the status byte is set then the SRQ signal is asserted (low)
-			// After a serial poll, SRQ line is de-asserted and status byte is set to 0 "
-			assert_signal(HCTRL2_CP, SRQ);
+		set_status((u8) atoi(args));
+	}
+}
+void do_devsel(const char *args) {
+	// ++devsel [<PAD> [<SAD>]]
+	// device mode : which ++addr device gets host data and ++status.
+	struct gpib_addrlist al;
+	unsigned i;
+
+	if (*args == 0) {
+		printf("%u", addr_group.pad[demu.sel]);
+		if (addr_group.sad[demu.sel]) {
+			printf(" %u", addr_group.sad[demu.sel]);
+		}
+		printf("\n");
+		return;
+	}
+	if (parse_addrlist(args, &al) || (al.n != 1)) {
+		printf("bad addr\n");
+		return;
+	}
+	for (i = 0; i < addr_group.n; i++) {
+		if ((addr_group.pad[i] == al.pad[0]) && (addr_group.sad[i] == al.sad[0])) {
+			demu.sel = i;
+			return;
 		}
 	}
+	printf("not in ++addr\n");
+}
+void do_devq(const char *args) {
+	// ++devq [clr]
+	// device mode output queue : print "<messages>,<free bytes>", or discard everything.
+	if (!strcmp(args, "clr")) {
+		devq_clear();
+		return;
+	}
+	printf("%u,%u\n", devq.nmsg, (unsigned) (DEVQ_SIZE - devq.used));
 }
 
 /** helper to print list of command names */
@@ -389,157 +829,1091 @@ void do_help(const char *args) {
 	(void) args;
 }
 
-void do_nothing(const char *args) {
-	(void) args;
-	DEBUG_PRINTF("Unrecognized command.\n");
+/** address target and write query text with EOI (after EOS if any) */
+static enum reply_status query_send(unsigned addr, const char *text, unsigned len) {
+	if (gpib_address_target(addr, CTRL_TALK) ||
+		gpib_cmd(gpib_cfg.myAddress + CMD_TAD)) {
+		return RS_TIMEOUT;
+	}
+	if (eos_len) {
+		if (gpib_write((const u8 *) text, len, 0) ||
+			gpib_write((const u8 *) eos_string, eos_len, 1)) {
+			return RS_TIMEOUT;
+		}
+	} else if (gpib_write((const u8 *) text, len, 1)) {
+		return RS_TIMEOUT;
+	}
+	return RS_OK;
 }
 
-/** Parse command
- *
- * @param cmd 0-split command plus args (starts with '+' or "++"), e.g. {"+a","31"}
- * @param cmd_len : len (excluding 0) of command token, e.g. strlen("+a:")
- * @param has_args : if 0, *args will point to a 0x00
- *
- */
-static void chunk_cmd(char *cmd, unsigned cmd_len, bool has_args) {
-	if (cmd_len == 0) {
-		//can happen if we receive a stray LF from host
-		return;
-	}
-	if (has_args) {
-		cmd_find_run(cmd, cmd_len, &cmd[cmd_len + 1]);
+/** read query reply from already addressed talker, until EOI or EOS */
+static enum reply_status query_read(void) {
+	enum errcodes rv;
+
+	if (eos_len) {
+		rv = gpib_read(GPIBREAD_EOI_EOS, eos_string[eos_len - 1], 0);
 	} else {
-		cmd_find_run(cmd, cmd_len, &cmd[cmd_len + 0]);  //trailing 0 of command
+		rv = gpib_read(GPIBREAD_EOI, 0, 0);
 	}
+	return rv ? RS_TIMEOUT : RS_OK;
 }
 
-/** parse data
- * @param rawdata chunk of (unescaped) data to send on GPIB bus
+void do_query(const char *args) {
+	// ++query <PAD> <text>
+	// write text with EOI, then read until EOI or EOS. Everything in one counted reply.
+	enum reply_status rs;
+	const char *text = strchr(args, ' ');
+	int addr = atoi(args);
+
+	host_reply_counted();
+	if (!gpib_cfg.controller_mode) {
+		rs = RS_EMODE;
+		goto done;
+	}
+	if ((text == NULL) || (text[1] == 0) || (addr < 0) || (addr > 30)) {
+		rs = RS_EINVAL;
+		goto done;
+	}
+	text++;
+
+	rs = query_send(addr, text, strlen(text));
+	if (rs) goto done;
+
+	// turnaround : we listen, target talks
+	if (gpib_address_target(addr, DEV_TALK)) {
+		rs = RS_TIMEOUT;
+		goto done;
+	}
+	rs = query_read();
+done:
+	host_reply_end(rs);
+}
+
+#define MQUERY_MAX	12
+#define STB_MAV	0x10    //488.2 "message available" status bit
+#define STB_RQS	0x40    //requested service
+
+struct mquery_item {
+	const char *text;
+	u16 len;
+	u8 addr;
+	bool pending;
+	u32 t_sent;
+};
+
+/** parse "<PAD> <text>[|<PAD> <text>...]"
+ * Secondary addresses are not supported : "<PAD>:<SAD>" is invalid rather than sent to the PAD.
+ * @return number of items, 0 if invalid
  */
-static void chunk_data(char *rawdata, unsigned len) {
-	char *buf_pnt = rawdata;
-	enum errcodes rv;
+static unsigned mquery_parse(const char *args, struct mquery_item *items) {
+	unsigned n = 0;
 
-	if (len == 0) {
-		//can happen if we receive a stray LF from host
-		return;
+	while (*args) {
+		const char *end = strchr(args, '|');
+		const char *text = args;
+		int addr = atoi(args);
+
+		while ((*text >= '0') && (*text <= '9')) {
+			text++;
+		}
+
+		if (end == NULL) {
+			end = args + strlen(args);
+		}
+		if ((n == MQUERY_MAX) || (text == args) || (*text != ' ') || ((text + 1) >= end) ||
+			(addr < 0) || (addr > 30)) {
+			return 0;
+		}
+		items[n].text = text + 1;
+		items[n].len = end - (text + 1);
+		items[n].addr = addr;
+		n++;
+		args = *end ? end + 1 : end;
 	}
+	return n;
+}
 
-	// Not an internal command, send to bus
-	// Command all talkers and listeners to stop
-	// and tell target to listen.
-	if (gpib_cfg.controller_mode) {
-		rv = gpib_address_target(gpib_cfg.partnerAddress, CTRL_TALK);
-		if (rv) return;
-		// Set the controller into talker mode
-		u8 cmd = gpib_cfg.myAddress + CMD_TAD;
-		rv = gpib_cmd(cmd);
-		if (rv) return;
+/** serial poll one item, and read its result as a tagged sub-reply if MAV is set.
+ * A talker is only addressed once it has a message, so no byte gets cut off.
+ * @param idx position in the list, used as tag
+ * @param stb (output) status byte, 0 if the poll failed
+ * @return 1 if done with this item
+ */
+static bool mquery_collect(const struct mquery_item *item, unsigned idx, u8 *stb) {
+	*stb = 0;
+	if (gpib_serial_poll(item->addr, 0, stb) ||
+		((*stb & STB_MAV) && gpib_address_target(item->addr, DEV_TALK))) {
+		*stb = 0;
+		host_reply_tagged(idx);
+		host_reply_end(RS_TIMEOUT);
+		return 1;
 	}
-	// Send out command to the bus
-	DEBUG_PRINTF("gpib_write: %.*s\n", len, buf_pnt);
-
-	if (gpib_cfg.controller_mode || gpib_cfg.device_talk) {
-		if (gpib_cfg.eos_code != EOS_NUL) {  // If have an EOS char, need to output
-			// termination byte to inst
-			rv = gpib_write((u8 *)buf_pnt, len, 0);
-			if (rv) return;
-			DEBUG_PRINTF("gpib_write eos[%u] (%02X...)", eos_len, eos_string[0]);
-			rv = gpib_write((u8 *) eos_string, eos_len, gpib_cfg.eoiUse);
-		} else {
-			rv = gpib_write((u8 *)buf_pnt, len, 1);
+	if (!(*stb & STB_MAV)) {
+		return 0;
+	}
+	host_reply_tagged(idx);
+	host_reply_end(query_read());
+	return 1;
+}
+
+void do_mquery(const char *args) {
+	// ++mquery <PAD> <text>[|<PAD> <text>...]
+	// send all queries first, then collect replies in whatever order instruments report MAV.
+	// Each result is a sub-reply tagged with its position in the list (0-based), so
+	// repeated addresses can be told apart; the final status covers the whole command.
+	struct mquery_item items[MQUERY_MAX];
+	unsigned n, idx, pending = 0;
+	enum reply_status rs = RS_OK;
+
+	host_reply_counted();
+	if (!gpib_cfg.controller_mode) {
+		rs = RS_EMODE;
+		goto done;
+	}
+	n = mquery_parse(args, items);
+	if (!n) {
+		rs = RS_EINVAL;
+		goto done;
+	}
+
+	for (idx = 0; idx < n; idx++) {
+		enum reply_status qrs = query_send(items[idx].addr, items[idx].text, items[idx].len);
+		items[idx].t_sent = get_ms();
+		items[idx].pending = (qrs == RS_OK);
+		if (qrs) {
+			host_reply_tagged(idx);
+			host_reply_end(qrs);
+			continue;
 		}
-		if (rv) return;
+		pending++;
 	}
+	gpib_unaddress();
+
+	while (pending) {
+		restart_wdt();
+		if (host_abort_pending()) {
+			rs = RS_ABORT;
+			break;
+		}
+		// with SRQ asserted, stop polling at the device that requested service;
+		// the others get their turn in the next round
+		bool srq = srq_state();
+		for (idx = 0; idx < n; idx++) {
+			struct mquery_item *item = &items[idx];
+			u8 stb;
 
-	if (gpib_cfg.autoread && gpib_cfg.controller_mode) {
-		gpib_address_target(gpib_cfg.partnerAddress, DEV_TALK);
-		rv = gpib_read(GPIBREAD_EOI, 0, gpib_cfg.eot_enable);
+			if (!item->pending) continue;
+
+			if (mquery_collect(item, idx, &stb)) {
+				item->pending = 0;
+				pending--;
+			} else if (TS_ELAPSED(get_ms(), item->t_sent, gpib_cfg.timeout)) {
+				host_reply_tagged(idx);
+				host_reply_end(RS_TIMEOUT);
+				item->pending = 0;
+				pending--;
+			}
+			if (srq && (stb & STB_RQS)) {
+				break;
+			}
+		}
 	}
+	gpib_unaddress();
+done:
+	host_reply_end(rs);
 }
 
+/**** autonomous scan / data-logger
+ *
+ * The scan list is run from the main loop (scan_poll()) every 'interval' ms.
+ * Each reading is sent to the host as
+ * "$<timestamp_ms>,<PAD>,<status>,<len>\n" followed by <len> bytes of data,
+ * or kept in a RAM log while no host has the port open.
+ */
+#define SCAN_MAX	8
+#define SCAN_TEXTSIZE	128 //all query strings
+#define SCAN_MAXDATA	48  //per reading; longer replies are truncated with RS_EFRAME
+#define SCAN_LOGSIZE	512
 
-static void listenonly(void) {
-	setControls(DLAS);
+struct scan_rec {
+	u32 ts;
+	u8 addr;
+	u8 status;  //enum reply_status
+	u8 len;
+};
 
-	assert_signal(HCTRL1_CP, NRFD);
+static struct {
+	u32 interval;   //0 : stopped
+	u32 next_due;
+	unsigned n;
+	struct {
+		u8 addr;
+		u8 offs;    //in text[]
+		u8 len;
+	} items[SCAN_MAX];
+	char text[SCAN_TEXTSIZE];
+	u8 log[SCAN_LOGSIZE];   //struct scan_rec + data, back to back (may wrap)
+	unsigned log_rp, log_wp, log_used;
+	unsigned lost;  //readings dropped because log was full
+	unsigned missed;    //scans skipped because the previous one took too long
+} scan = {0};
 
-	// if DAV=1 , not valid : return
-	if (gpio_get(HCTRL1_CP, DAV)) {
-		return;
+static void scan_log_put(const u8 *src, unsigned len) {
+	while (len--) {
+		scan.log[scan.log_wp] = *src++;
+		scan.log_wp = (scan.log_wp + 1) % SCAN_LOGSIZE;
 	}
-	bool atn_state = !gpio_get(HCTRL2_CP, ATN);
+}
 
-	if (atn_state) {
-		u8 rxb;
-		bool eoi_status;
-		gpib_read_byte(&rxb, &eoi_status);
-		DEBUG_PRINTF("listenonly : CMD %02X\n", rxb);
-	} else {
-		gpib_read(GPIBREAD_EOI, 0, 0);
+static void scan_log_get(u8 *dst, unsigned len) {
+	while (len--) {
+		*dst++ = scan.log[scan.log_rp];
+		scan.log_rp = (scan.log_rp + 1) % SCAN_LOGSIZE;
 	}
 }
 
-//fwd decls for two helper functions
-static void device_atn(void);
-static void device_noatn(void);
+static void scan_send(const struct scan_rec *rec, const u8 *data) {
+	printf("$%lu,%u,%u,%u\n", (unsigned long) rec->ts,
+		   (unsigned) rec->addr, (unsigned) rec->status, (unsigned) rec->len);
+	unsigned idx;
+	for (idx = 0; idx < rec->len; idx++) {
+		host_tx_blocking(data[idx]);
+	}
+}
 
+/** send logged readings, oldest first */
+static void scan_drain(void) {
+	struct scan_rec rec;
+	u8 data[SCAN_MAXDATA];
 
-/** device mode poll */
-static void device_poll(void) {
-	// When in device mode, need to monitor IFC and ATN.
-	// but we certainly don't respect t2 <= 200ns for responding to ATN...
-	// but we have t1 (100us) to respond to IFC ?
+	while (scan.log_used) {
+		scan_log_get((u8 *) &rec, sizeof(rec));
+		scan_log_get(data, rec.len);
+		scan.log_used -= sizeof(rec) + rec.len;
+		scan_send(&rec, data);
+	}
+}
 
-	if (!gpio_get(HCTRL2_CP, IFC)) {
-		gpib_cfg.device_talk = 0;
-		gpib_cfg.device_listen = 0;
-		gpib_cfg.device_srq = 0;
-		status_byte = 0;
+static void scan_record(const struct scan_rec *rec, const u8 *data) {
+	unsigned reclen = sizeof(*rec) + rec->len;
+
+	if (fwusb_host_avail()) {
+		scan_drain();
+		scan_send(rec, data);
 		return;
 	}
-
-	if (!gpio_get(HCTRL2_CP, ATN)) {
-		device_atn();
-	} else {
-		device_noatn();
+	if ((scan.log_used + reclen) > SCAN_LOGSIZE) {
+		scan.lost++;
+		return;
 	}
+	scan_log_put((const u8 *) rec, sizeof(*rec));
+	scan_log_put(data, rec->len);
+	scan.log_used += reclen;
 }
 
-/** device poll with ATN asserted (==0) */
-static void device_atn(void) {
-	bool eoi_status;
-	dio_float();
-	setControls(DLAS);
+/** run the whole scan list once */
+static void scan_run(void) {
+	unsigned idx;
 
-	// Get the CMD byte sent by the controller
-	u8 rxb;
-	enum errcodes rv = gpib_read_byte(&rxb, &eoi_status);
-	setControls(DIDS);
-	if (rv) {
-		//error (timeout ?)
+	for (idx = 0; idx < scan.n; idx++) {
+		struct scan_rec rec;
+		u8 data[SCAN_MAXDATA];
+		unsigned len = 0;
+		enum reply_status rs;
+
+		restart_wdt();
+		rec.addr = scan.items[idx].addr;
+		rec.ts = get_ms();
+		rs = query_send(rec.addr, &scan.text[scan.items[idx].offs], scan.items[idx].len);
+		if ((rs == RS_OK) && gpib_address_target(rec.addr, DEV_TALK)) {
+			rs = RS_TIMEOUT;
+		}
+		if (rs == RS_OK) {
+			len = sizeof(data);
+			switch (gpib_read_buf(data, &len, eos_len ? eos_string[eos_len - 1] : -1)) {
+			case E_OK:
+				break;
+			case E_FIFO:
+				rs = RS_EFRAME;
+				break;
+			default:
+				rs = RS_TIMEOUT;
+				break;
+			}
+		}
+		rec.status = rs;
+		rec.len = len;
+		scan_record(&rec, data);
+	}
+	gpib_unaddress();
+}
+
+void scan_poll(void) {
+	if (scan.log_used && fwusb_host_avail()) {
+		scan_drain();
+	}
+	if (!scan.interval || !gpib_cfg.controller_mode) {
 		return;
 	}
-	if ((rxb & 0xE0) == CMD_TAD) {
-		if (rxb == gpib_cfg.partnerAddress + CMD_TAD) {
-			gpib_cfg.device_talk = true;
-			gpib_cfg.device_listen = 0;
-			DEBUG_PRINTF("Instructed to talk\n");
-		} else {
-			//somebody else is addressed to talk
-			gpib_cfg.device_talk = 0;
-		}
-	} else if (rxb == gpib_cfg.partnerAddress + CMD_LAD) {
-		gpib_cfg.device_talk = 0;
-		gpib_cfg.device_listen = true;
-		DEBUG_PRINTF("Instructed to listen\n");
-	} else if (rxb == CMD_UNL) {
-		gpib_cfg.device_listen = false;
-		DEBUG_PRINTF("Instructed to stop listen\n");
-	} else if (rxb == CMD_UNT) {
-		gpib_cfg.device_talk = false;
-		DEBUG_PRINTF("Instructed to stop talk\n");
-	} else if (rxb == CMD_SPE) {
+	u32 now = get_ms();
+	if ((int32_t) (now - scan.next_due) < 0) {
+		//not due yet
+		return;
+	}
+	scan_run();
+
+	// keep a fixed schedule; if we fell behind, skip ahead
+	scan.next_due += scan.interval;
+	now = get_ms();
+	if ((int32_t) (now - scan.next_due) >= 0) {
+		scan.missed += 1 + (now - scan.next_due) / scan.interval;
+		scan.next_due = now + scan.interval;
+	}
+}
+
+void do_scan(const char *args) {
+	// ++scan [<interval_ms> <PAD> <text>[|<PAD> <text>...]]
+	// ++scan 0 : stop
+	struct mquery_item items[MQUERY_MAX];
+	unsigned n, idx, offs = 0;
+
+	if (*args == 0) {
+		printf("%lu %u %u %u %u\n", (unsigned long) scan.interval, scan.n,
+			   scan.log_used, scan.lost, scan.missed);
+		return;
+	}
+	u32 interval = (u32) atoi(args);
+	if ((*args == '0') && !interval) {
+		scan.interval = 0;
+		return;
+	}
+
+	// validate everything before touching a running scan
+	const char *list = strchr(args, ' ');
+	n = list ? mquery_parse(list + 1, items) : 0;
+	for (idx = 0; idx < n; idx++) {
+		offs += items[idx].len;
+	}
+	if (!interval || !n || (n > SCAN_MAX) || (offs > SCAN_TEXTSIZE)) {
+		printf("bad scan list\n");
+		return;
+	}
+	if (!gpib_cfg.controller_mode) return;
+
+	for (idx = 0, offs = 0; idx < n; idx++) {
+		memcpy(&scan.text[offs], items[idx].text, items[idx].len);
+		scan.items[idx].addr = items[idx].addr;
+		scan.items[idx].offs = offs;
+		scan.items[idx].len = items[idx].len;
+		offs += items[idx].len;
+	}
+	scan.n = n;
+	scan.lost = 0;
+	scan.missed = 0;
+	scan.next_due = get_ms();
+	scan.interval = interval;
+}
+
+#define TSEQ_PREP_US	2000    //start the GET handshake this long before firing
+
+void do_tseq(const char *args) {
+	// ++tseq <period_us> <count> <read:0|1> <PAD1> [<SAD1>] [<PAD2> [<SAD2>] ...]
+	// send GET to the listener group every period_us, timed with systick.
+	// Sends "T<n>,<t_us>,<late_us>\n" after each trigger; with read=1, every listener
+	// is then read back as a tagged sub-reply. Everything is in one counted reply.
+	struct gpib_addrlist al;
+	enum reply_status rs = RS_OK;
+
+	host_reply_counted();
+	if (!gpib_cfg.controller_mode) {
+		rs = RS_EMODE;
+		goto done;
+	}
+	u32 period = (u32) atoi(args);
+	args = next_arg(args);
+	unsigned count = atoi(args);
+	args = next_arg(args);
+	bool readback = atoi(args);
+	args = next_arg(args);
+	if (!period || !count || parse_addrlist(args, &al)) {
+		rs = RS_EINVAL;
+		goto done;
+	}
+
+	u32 t_next = get_us32() + 2 * TSEQ_PREP_US;
+	unsigned idx;
+	for (idx = 0; idx < count; idx++) {
+		u32 t_fire;
+		unsigned li;
+
+		if ((idx == 0) || readback) {
+			// (re)address listener group
+			if (gpib_address_list(&al, CTRL_TALK)) {
+				rs = RS_TIMEOUT;
+				break;
+			}
+		}
+		while ((int32_t) (t_next - get_us32()) > TSEQ_PREP_US) {
+			restart_wdt();
+			if (host_rx_datapresent() || host_abort_pending()) {
+				rs = RS_ABORT;
+				goto done;
+			}
+		}
+		if (gpib_cmd_timed(CMD_GET, t_next, &t_fire)) {
+			rs = RS_TIMEOUT;
+			break;
+		}
+		printf("T%u,%lu,%ld\n", idx, (unsigned long) t_fire, (long) (t_fire - t_next));
+
+		for (li = 0; readback && (li < al.n); li++) {
+			struct gpib_addrlist talker = {1, {al.pad[li]}, {al.sad[li]}};
+			host_reply_tagged(al.pad[li]);
+			if (gpib_address_list(&talker, DEV_TALK)) {
+				host_reply_end(RS_TIMEOUT);
+				continue;
+			}
+			host_reply_end(query_read());
+		}
+		t_next += period;
+	}
+	gpib_unaddress();
+done:
+	host_reply_end(rs);
+}
+
+void do_binmode(const char *args) {
+	// ++bin
+	(void) args;
+	host_set_framed(1);
+	// empty reply, so the host knows when to start sending frames
+	host_reply_begin(FT_CMD, 0, FRAME_ADDR_DEFAULT);
+	host_reply_end(RS_OK);
+}
+
+void do_nothing(const char *args) {
+	(void) args;
+	DEBUG_PRINTF("Unrecognized command.\n");
+}
+
+/** Parse command
+ *
+ * @param cmd 0-terminated command plus args (starts with '+' or "++"), e.g. "++addr 31".
+ * Tokenized in-place.
+ * @param len : strlen(cmd)
+ * @return 0 if command not found
+ */
+static bool chunk_cmd(char *cmd, unsigned len) {
+	if (len == 0) {
+		//can happen if we receive a stray LF from host
+		return 0;
+	}
+	char *sp = memchr(cmd, ' ', len);
+	if (sp) {
+		//commands of form "++<cmd> <args>": split args on ' '
+		*sp = 0;
+		return cmd_find_run(cmd, sp - cmd, sp + 1);
+	}
+	return cmd_find_run(cmd, len, &cmd[len]);  //trailing 0 of command
+}
+
+/** IEEE 488.2 query detection : '?' in the header of any program message unit.
+ * Units are separated by ';', headers end at whitespace. Quoted strings
+ * in program data are skipped.
+ */
+static bool is_query(const struct rx_chunk *chunk) {
+	enum {PH_LEAD, PH_HEADER, PH_DATA} ph = PH_LEAD;
+	char quote = 0;
+	unsigned seg, i;
+
+	for (seg = 0; seg < 2; seg++) {
+		for (i = 0; i < chunk->len[seg]; i++) {
+			char c = chunk->data[seg][i];
+			bool ws = (c == ' ') || (c == '\t');
+			if (quote) {
+				if (c == quote) quote = 0;
+				continue;
+			}
+			switch (ph) {
+			case PH_LEAD:
+				if (ws) break;
+				ph = PH_HEADER;
+			// fallthrough
+			case PH_HEADER:
+				if (c == '?') return 1;
+				if (c == ';') {
+					ph = PH_LEAD;
+				} else if (ws) {
+					ph = PH_DATA;
+				}
+				break;
+			case PH_DATA:
+				if ((c == '"') || (c == '\'')) {
+					quote = c;
+				} else if (c == ';') {
+					ph = PH_LEAD;
+				}
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+/** decide if data just written should be followed by a read */
+static bool autoread_wanted(const struct rx_chunk *chunk) {
+	u8 stb;
+
+	switch (gpib_cfg.autoread) {
+	case AUTOREAD_ALWAYS:
+		return 1;
+	case AUTOREAD_QUERY:
+		return is_query(chunk);
+	case AUTOREAD_QUERY_MAV:
+		if (is_query(chunk)) return 1;
+		// poll the device that would be read : the first of the ++addr group
+		return !gpib_serial_poll(addr_group.pad[0], addr_group.sad[0], &stb) && (stb & STB_MAV);
+	default:
+		break;
+	}
+	return 0;
+}
+
+static enum errcodes chunk_data(const struct rx_chunk *chunk);
+
+/** run "<tag> <command or data>" from "++tag <tag> ..."
+ *
+ * All output goes in one counted reply with headers "#<tag>:<status>,<len>\n";
+ * the last status is the completion status. The rest of the line is a single
+ * command (no ";++" batch), or data to write; escapes are stripped.
+ * @param line 0-terminated, tokenized in-place
+ * @param len : strlen(line)
+ */
+static void chunk_tagged(char *line, unsigned len) {
+	enum reply_status rs = RS_OK;
+	char *sp = memchr(line, ' ', len);
+	int tag = atoi(line);
+
+	if (!sp || (tag < 0) || (tag > 255)) {
+		host_reply_counted();
+		host_reply_end(RS_EINVAL);
+		return;
+	}
+	len -= (sp + 1) - line;
+	line = sp + 1;
+	len = cmd_unescape(line, len);
+
+	host_reply_counted_tag(tag);
+	if (line[0] == '+') {
+		if (!chunk_cmd(line, len)) {
+			rs = RS_EINVAL;
+		}
+	} else {
+		struct rx_chunk chunk = {
+			.data = {(u8 *) line, NULL},
+			.len = {len, 0},
+			.type = CHUNK_DATA,
+		};
+		if (chunk_data(&chunk)) {
+			rs = RS_TIMEOUT;
+		}
+	}
+	host_reply_end(rs);   //no effect if the command ended the reply itself
+}
+
+/** Parse command line, possibly a batch like "++addr 5;++eos 3;++read eoi"
+ *
+ * Commands are only split on unescaped ";++", see cmd_batch.h.
+ * In a batch, each command's output is a counted reply, with status RS_EINVAL
+ * for unknown or empty commands; a single command behaves as usual.
+ * @param line 0-terminated, tokenized in-place
+ * @param len : strlen(line)
+ */
+static void chunk_cmdline(char *line, unsigned len) {
+	if (!strncmp(line, "++tag ", 6)) {
+		chunk_tagged(&line[6], len - 6);
+		return;
+	}
+	if (!find_cmdsep(line, len)) {
+		chunk_cmd(line, cmd_unescape(line, len));
+		return;
+	}
+	while (line && !host_abort_pending()) {
+		char *cmd = line;
+		unsigned clen = cmd_split(&line, &len);
+
+		host_reply_counted();
+		bool found = chunk_cmd(cmd, clen);
+		host_reply_end(found ? RS_OK : RS_EINVAL);   //no effect if the command ended the reply itself
+	}
+}
+
+/** queue message for device mode output, adding EOS if enabled
+ * @param dev index in addr_group
+ * @return E_FIFO if it doesn't fit
+ */
+static enum errcodes devq_put(const struct rx_chunk *chunk, unsigned dev) {
+	unsigned elen = (gpib_cfg.eos_code != EOS_NUL) ? eos_len : 0;
+	unsigned len = chunk->len[0] + chunk->len[1] + elen;
+	u8 *dst = &devq.buf[devq.used];
+	unsigned seg;
+
+	if ((devq.nmsg == DEVQ_MSGS) || ((devq.used + len) > DEVQ_SIZE)) {
+		DEBUG_PRINTF("devq full\n");
+		return E_FIFO;
+	}
+	for (seg = 0; seg < 2; seg++) {
+		if (!chunk->len[seg]) continue;
+		memcpy(dst, chunk->data[seg], chunk->len[seg]);
+		dst += chunk->len[seg];
+	}
+	memcpy(dst, eos_string, elen);
+
+	devq.len[devq.nmsg] = len;
+	devq.dev[devq.nmsg++] = dev;
+	devq.used += len;
+	return E_OK;
+}
+
+/** find dcache entry
+ * @return offset of entry, or -1
+ */
+static int dcache_find(const char *query, unsigned len) {
+	unsigned pos = 0;
+
+	while (pos < dcache.used) {
+		const char *q = &dcache.buf[pos];
+		unsigned qlen = strlen(q);
+		if ((qlen == len) && !memcmp(q, query, len)) {
+			return pos;
+		}
+		pos += qlen + 1;
+		pos += strlen(&dcache.buf[pos]) + 1;
+	}
+	return -1;
+}
+
+static void dcache_delete(int pos) {
+	unsigned elen = strlen(&dcache.buf[pos]) + 1;
+	elen += strlen(&dcache.buf[pos + elen]) + 1;
+	dcache.used -= elen;
+	memmove(&dcache.buf[pos], &dcache.buf[pos + elen], dcache.used - pos);
+}
+
+/** queue cached response if the message from the controller matches.
+ * Trailing CR / LF are ignored.
+ */
+static void dcache_answer(const u8 *msg, unsigned len, unsigned dev) {
+	if (len > DCACHE_MSGMAX) {
+		return;
+	}
+	while (len && ((msg[len - 1] == '\r') || (msg[len - 1] == '\n'))) {
+		len--;
+	}
+	int pos = dcache_find((const char *) msg, len);
+	if (pos < 0) {
+		return;
+	}
+	const char *resp = &dcache.buf[pos + len + 1];
+	struct rx_chunk chunk = {
+		.data = {(u8 *) resp, NULL},
+		.len = {strlen(resp), 0},
+		.type = CHUNK_DATA,
+	};
+	DEBUG_PRINTF("dcache hit : %s\n", resp);
+	(void) devq_put(&chunk, dev);
+}
+
+static void print_dcache(void) {
+	unsigned pos = 0;
+
+	while (pos < dcache.used) {
+		const char *q = &dcache.buf[pos];
+		pos += strlen(q) + 1;
+		printf("%s|%s\n", q, &dcache.buf[pos]);
+		pos += strlen(&dcache.buf[pos]) + 1;
+	}
+}
+
+void do_dcache(const char *args) {
+	// ++dcache [<query>|<response> | <query>| | *]
+	// device mode : answer <query> from the controller with <response>, without the host.
+	// Empty response deletes the entry; '*' deletes all. Without args, list entries.
+	const char *sep = strchr(args, '|');
+
+	if (*args == 0) {
+		print_dcache();
+		return;
+	}
+	if (!strcmp(args, "*")) {
+		dcache.used = 0;
+		return;
+	}
+	if (!sep || (sep == args) || ((unsigned) (sep - args) > DCACHE_MSGMAX)) {
+		printf("bad entry\n");
+		return;
+	}
+	unsigned qlen = sep - args;
+	unsigned rlen = strlen(sep + 1);
+	int pos = dcache_find(args, qlen);
+	if (pos >= 0) {
+		dcache_delete(pos);
+	}
+	if (!rlen) {
+		return;
+	}
+	if ((dcache.used + qlen + rlen + 2) > DCACHE_SIZE) {
+		printf("dcache full\n");
+		return;
+	}
+	memcpy(&dcache.buf[dcache.used], args, qlen);
+	dcache.buf[dcache.used + qlen] = 0;
+	memcpy(&dcache.buf[dcache.used + qlen + 1], sep + 1, rlen + 1);
+	dcache.used += qlen + rlen + 2;
+}
+
+/** parse data
+ * @param chunk (unescaped) data to send on GPIB bus
+ * @return E_OK or bus error
+ */
+static enum errcodes chunk_data(const struct rx_chunk *chunk) {
+	unsigned len = chunk->len[0] + chunk->len[1];
+	enum errcodes rv;
+
+	if (len == 0) {
+		//can happen if we receive a stray LF from host
+		return E_OK;
+	}
+
+	if (!gpib_cfg.controller_mode) {
+		// sent by device_noatn() when the controller addresses us to talk
+		return devq_put(chunk, demu.sel);
+	}
+
+	// Not an internal command, send to bus
+	// Command all talkers and listeners to stop
+	// and tell target to listen.
+	rv = gpib_address_list(&addr_group, CTRL_TALK);
+	if (rv) return rv;
+	// Set the controller into talker mode
+	u8 cmd = gpib_cfg.myAddress + CMD_TAD;
+	rv = gpib_cmd(cmd);
+	if (rv) return rv;
+
+	// Send out command to the bus
+	DEBUG_PRINTF("gpib_write: %.*s%.*s\n", chunk->len[0], chunk->data[0], chunk->len[1], chunk->data[1]);
+
+	bool use_eos = (gpib_cfg.eos_code != EOS_NUL);
+	unsigned seg;
+	for (seg = 0; seg < 2; seg++) {
+		if (!chunk->len[seg]) continue;
+		// without EOS, assert EOI on the last byte of the last segment
+		bool last = (seg == 1) || !chunk->len[1];
+		rv = gpib_write(chunk->data[seg], chunk->len[seg], last && !use_eos);
+		if (rv) return rv;
+	}
+	if (use_eos) {  // If have an EOS char, need to output
+		// termination byte to inst
+		DEBUG_PRINTF("gpib_write eos[%u] (%02X...)", eos_len, eos_string[0]);
+		rv = gpib_write((u8 *) eos_string, eos_len, gpib_cfg.eoiUse);
+		if (rv) return rv;
+	}
+
+	if (autoread_wanted(chunk)) {
+		gpib_address_list(&addr_group, DEV_TALK);
+		host_read(GPIBREAD_EOI, 0);
+	}
+	return E_OK;
+}
+
+
+/** write frame payload to bus
+ * @return RS_OK or error status
+ */
+static enum reply_status frame_write(const struct rx_chunk *chunk, unsigned addr) {
+	const struct frame_hdr *hdr = &chunk->hdr;
+	unsigned seg;
+
+	if (!(hdr->flags & FF_CONT)) {
+		if (gpib_address_target(addr, CTRL_TALK)) return RS_TIMEOUT;
+		if (gpib_cmd(gpib_cfg.myAddress + CMD_TAD)) return RS_TIMEOUT;
+	}
+	for (seg = 0; seg < 2; seg++) {
+		if (!chunk->len[seg]) continue;
+		bool last = (seg == 1) || !chunk->len[1];
+		if (gpib_write(chunk->data[seg], chunk->len[seg], last && (hdr->flags & FF_EOI))) {
+			return RS_TIMEOUT;
+		}
+	}
+	return RS_OK;
+}
+
+/** read from bus into reply
+ * @param eos_char if < 0, read until EOI
+ * @return RS_OK or error status
+ */
+static enum reply_status frame_read(unsigned addr, bool addressed, int eos_char) {
+	enum errcodes rv;
+
+	if (!addressed) {
+		if (gpib_address_target(addr, DEV_TALK)) return RS_TIMEOUT;
+	}
+	if (eos_char >= 0) {
+		rv = gpib_read(GPIBREAD_EOS, eos_char, 0);
+	} else {
+		rv = gpib_read(GPIBREAD_EOI, 0, 0);
+	}
+	return rv ? RS_TIMEOUT : RS_OK;
+}
+
+/** parse binary frame, and send reply */
+static void chunk_frame(const struct rx_chunk *chunk) {
+	const struct frame_hdr *hdr = &chunk->hdr;
+	unsigned len = chunk->len[0] + chunk->len[1];
+	unsigned addr = hdr->addr;
+	enum reply_status rs = RS_OK;
+
+	host_reply_begin(hdr->type, hdr->seq, hdr->addr);
+
+	if (addr == FRAME_ADDR_DEFAULT) {
+		addr = gpib_cfg.partnerAddress;
+	}
+	if (chunk->flags & CHUNK_F_OVERFLOW) {
+		rs = RS_EFRAME;
+		goto done;
+	}
+
+	switch (hdr->type) {
+	case FT_CMD:
+		//contiguous and 0-terminated, like text commands
+		if (!chunk_cmd((char *) chunk->data[0], len)) {
+			rs = RS_EINVAL;
+		}
+		break;
+	case FT_WRITE:
+	case FT_READ:
+		if (!gpib_cfg.controller_mode) {
+			rs = RS_EMODE;
+			break;
+		}
+		if (addr > 30) {
+			rs = RS_EINVAL;
+			break;
+		}
+		if (hdr->type == FT_READ) {
+			int eos_char = -1;
+			if (hdr->flags & FF_EOS) {
+				if (!len) {
+					rs = RS_EINVAL;
+					break;
+				}
+				eos_char = chunk->data[chunk->len[0] ? 0 : 1][0];
+			}
+			rs = frame_read(addr, hdr->flags & FF_CONT, eos_char);
+			break;
+		}
+		rs = frame_write(chunk, addr);
+		if ((rs == RS_OK) && (hdr->flags & FF_READ)) {
+			rs = frame_read(addr, 0, -1);
+		}
+		break;
+	case FT_EXIT:
+		//input was already switched back to text mode, since this frame wasn't skipped
+		host_reply_end(RS_OK);
+		host_set_framed(0);
+		return;
+	default:
+		rs = RS_EINVAL;
+		break;
+	}
+done:
+	host_reply_end(rs);
+}
+
+
+static void listenonly(void) {
+	setControls(DLAS);
+
+	assert_signal(HCTRL1_CP, NRFD);
+
+	// if DAV=1 , not valid : return
+	if (gpio_get(HCTRL1_CP, DAV)) {
+		return;
+	}
+	bool atn_state = !gpio_get(HCTRL2_CP, ATN);
+
+	if (atn_state) {
+		u8 rxb;
+		bool eoi_status;
+		gpib_read_byte(&rxb, &eoi_status);
+		DEBUG_PRINTF("listenonly : CMD %02X\n", rxb);
+	} else {
+		gpib_read(GPIBREAD_EOI, 0, 0);
+	}
+}
+
+//fwd decls for two helper functions
+static void device_atn(void);
+static void device_noatn(void);
+
+/** remove bytes from the start of queued message m; drop the message once empty */
+static void devq_consume(unsigned m, unsigned len) {
+	unsigned pos = 0;
+	unsigned i;
+
+	for (i = 0; i < m; i++) {
+		pos += devq.len[i];
+	}
+	devq.used -= len;
+	memmove(&devq.buf[pos], &devq.buf[pos + len], devq.used - pos);
+	devq.len[m] -= len;
+	if (devq.len[m]) {
+		return;
+	}
+	devq.nmsg--;
+	memmove(&devq.len[m], &devq.len[m + 1], (devq.nmsg - m) * sizeof(devq.len[0]));
+	memmove(&devq.dev[m], &devq.dev[m + 1], (devq.nmsg - m) * sizeof(devq.dev[0]));
+}
+
+/** drop queued messages of the devices in mask */
+static void devq_drop(unsigned mask) {
+	unsigned m = 0;
+
+	while (m < devq.nmsg) {
+		if (mask & (1U << devq.dev[m])) {
+			devq_consume(m, devq.len[m]);
+		} else {
+			m++;
+		}
+	}
+}
+
+/** send first message queued for device dev; the rest of it goes at the next
+ * talk addressing if the controller takes the bus back (ATN) before the end.
+ */
+static void devq_source(unsigned dev) {
+	unsigned pos = 0;
+	unsigned m;
+
+	for (m = 0; m < devq.nmsg; m++) {
+		if (devq.dev[m] == dev) {
+			devq_consume(m, gpib_device_talk(&devq.buf[pos], devq.len[m], 1));
+			return;
+		}
+		pos += devq.len[m];
+	}
+}
+
+/** first listening device, -1 if none */
+static int demu_listener(void) {
+	unsigned i;
+
+	for (i = 0; i < addr_group.n; i++) {
+		if (demu.listen & (1U << i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/** reply tag for host data of device idx : its SAD if it has one, else its PAD */
+static unsigned demu_tag(unsigned idx) {
+	return addr_group.sad[idx] ? addr_group.sad[idx] : addr_group.pad[idx];
+}
+
+static void demu_address(unsigned idx, bool talk) {
+	if (talk) {
+		demu.talker = idx;
+		demu.listen &= ~(1U << idx);
+		DEBUG_PRINTF("Instructed to talk\n");
+	} else {
+		demu.listen |= 1U << idx;
+		if (demu.talker == (int) idx) {
+			demu.talker = -1;
+		}
+		devmsg.len = 0;
+		DEBUG_PRINTF("Instructed to listen\n");
+	}
+}
+
+/** TAD / LAD received : devices without SAD are addressed now, the others on a matching SAD */
+static void demu_primary(u8 pad, bool talk) {
+	unsigned i;
+
+	demu.pending_pad = -1;
+	for (i = 0; i < addr_group.n; i++) {
+		if (addr_group.pad[i] != pad) continue;
+		if (addr_group.sad[i]) {
+			demu.pending_pad = pad;
+			demu.pending_talk = talk;
+		} else {
+			demu_address(i, talk);
+		}
+	}
+}
+
+static void demu_secondary(u8 sad) {
+	unsigned i;
+
+	if (demu.pending_pad < 0) {
+		return;
+	}
+	for (i = 0; i < addr_group.n; i++) {
+		if ((addr_group.pad[i] == demu.pending_pad) && (addr_group.sad[i] == sad)) {
+			demu_address(i, demu.pending_talk);
+		}
+	}
+}
+
+
+/** device mode poll */
+static void device_poll(void) {
+	// When in device mode, need to monitor IFC and ATN.
+	// The EXTI handlers already took care of the handshake lines (see bus_irq_enable);
+	// IFC is latched there since it may be shorter than one main loop iteration.
+
+	if (bus_ifc_seen(1) || !gpio_get(HCTRL2_CP, IFC)) {
+		demu_unaddress();
+		gpib_cfg.device_srq = 0;
+		memset(demu.stb, 0, sizeof(demu.stb));
+		update_srq();
+		return;
+	}
+
+	if (!gpio_get(HCTRL2_CP, ATN)) {
+		device_atn();
+	} else {
+		device_noatn();
+	}
+}
+
+/** device poll with ATN asserted (==0) */
+static void device_atn(void) {
+	// Get the CMD byte sent by the controller
+	u8 rxb;
+	enum errcodes rv = gpib_device_cmd(&rxb);
+	if (rv) {
+		//ATN released, or timeout
+		return;
+	}
+	if ((rxb & 0xE0) == CMD_TAD) {
+		// one talker on the bus : a new TAD (or UNT) unaddresses ours
+		demu.talker = -1;
+		if (rxb == CMD_UNT) {
+			demu.pending_pad = -1;
+			DEBUG_PRINTF("Instructed to stop talk\n");
+		} else {
+			demu_primary(rxb - CMD_TAD, 1);
+		}
+	} else if (rxb == CMD_UNL) {
+		demu.listen = 0;
+		demu.pending_pad = -1;
+		DEBUG_PRINTF("Instructed to stop listen\n");
+	} else if ((rxb & 0xE0) == CMD_LAD) {
+		demu_primary(rxb - CMD_LAD, 0);
+	} else if ((rxb >= CMD_SAD) && (rxb < (CMD_SAD + 31))) {
+		demu_secondary(rxb);
+	} else if (rxb == CMD_SPE) {
 		gpib_cfg.device_srq = true;
 		DEBUG_PRINTF("SQR start\n");
 	} else if (rxb == CMD_SPD) {
@@ -547,10 +1921,11 @@ static void device_atn(void) {
 		DEBUG_PRINTF("SQR end\n");
 	} else if (rxb == CMD_DCL) {
 		DEBUG_PRINTF("DCL\n");
-		gpib_cfg.device_listen = false;
-		gpib_cfg.device_talk = false;
+		demu_unaddress();
 		gpib_cfg.device_srq = false;
-		status_byte = 0;
+		memset(demu.stb, 0, sizeof(demu.stb));
+		update_srq();
+		devq_clear();
 	} else if ((rxb == CMD_LLO) && (gpib_cfg.device_listen)) {
 		DEBUG_PRINTF("LLO\n");
 	} else if ((rxb == CMD_GTL) && (gpib_cfg.device_listen)) {
@@ -558,141 +1933,397 @@ static void device_atn(void) {
 	} else if ((rxb == CMD_GET) && (gpib_cfg.device_listen)) {
 		DEBUG_PRINTF("GET\n");
 	} else if ((rxb == CMD_SDC) && (gpib_cfg.device_listen)) {
+		unsigned i;
 		DEBUG_PRINTF("SDC\n");
-		gpib_cfg.device_listen = false;
-		gpib_cfg.device_talk = false;
+		for (i = 0; i < addr_group.n; i++) {
+			if (demu.listen & (1U << i)) {
+				demu.stb[i] = 0;
+			}
+		}
+		update_srq();
+		devq_drop(demu.listen);
+		devmsg.len = 0;
+		demu_unaddress();
 		gpib_cfg.device_srq = false;
-		status_byte = 0;
 	}
+	gpib_cfg.device_talk = (demu.talker >= 0);
+	gpib_cfg.device_listen = (demu.listen != 0);
 }
 
 /** device poll with ATN not asserted (==1) */
 static void device_noatn(void) {
 	if (gpib_cfg.device_listen) {
-		dio_float();
-		setControls(DLAS);
+		// stream everything to the host until EOI, ATN (e.g. UNL) or host input.
+		// With several devices, the data goes in a reply tagged with the listener's address;
+		// if more than one listens, they all got the same bytes.
+		int li = demu_listener();
+		bool tagged = (addr_group.n > 1);
+		unsigned prevlen = devmsg.len;
 
-		DEBUG_PRINTF("device mode gpib_read\n");
-		u8 rxb;
-		bool eoi_status;
-		gpib_read_byte(&rxb, &eoi_status);
-		setControls(DIDS);
-		DEBUG_PRINTF("devpoll noATN got %u", (unsigned) rxb);
+		if (tagged) {
+			host_reply_counted_tag(demu_tag(li));
+		}
+		enum gpib_readend re = gpib_device_listen(gpib_cfg.eot_enable,
+								devmsg.buf, sizeof(devmsg.buf), &devmsg.len);
+		if (tagged) {
+			if (devmsg.len == prevlen) {
+				host_reply_cancel();
+			} else {
+				host_reply_end(readend_status[re]);
+			}
+		}
+		if (devmsg.len && ((re == READEND_EOI) || !gpio_get(HCTRL2_CP, ATN))) {
+			// end of message
+			dcache_answer(devmsg.buf, devmsg.len, li);
+			devmsg.len = 0;
+		}
 	} else if (gpib_cfg.device_talk) {
-		setControls(DTAS);
 		if (gpib_cfg.device_srq) {
-			gpib_write(&status_byte, 1, 0);
-			unassert_signal(HCTRL2_CP, SRQ);
+			setControls(DTAS);
+			gpib_write(&demu.stb[demu.talker], 1, 0);
 			gpib_cfg.device_srq = false;
-			status_byte = 0;
+			demu.stb[demu.talker] = 0;
+			update_srq();
+			setControls(DIDS);
+		} else if (devq.nmsg) {
+			devq_source(demu.talker);
 		}
-		setControls(DIDS);
 	}
 }
 
 
-void cmd_poll(void) {
-	u8 rxb;
-	static u8 input_buf[HOST_IN_BUFSIZE];
-	static unsigned in_len = 0;
-	static unsigned cmd_len = 0;    //length of command token, excluding 0 termination.
-	static unsigned arg_pos = 0;
-	static bool in_cmd = 0;
-	static bool escape_next = 0;
-	static bool wait_guardbyte = 0;
-	static bool has_args = 0;
+/* changes received as vendor requests, for the main loop */
+static struct {
+	volatile bool cfg_pending;
+	volatile bool stb_pending;
+	u8 cfg[CFGBLOB_LEN];
+	u8 stb;
+} vreq = {0};
 
-	restart_wdt();
+int cmd_vendor_request(uint8_t req, uint16_t wValue, uint8_t *buf, uint16_t *len) {
+	unsigned rx_ovf, tx_ovf;
 
-	if (listen_only) {
-		listenonly();
-	} else if (!gpib_cfg.controller_mode) {
-		device_poll();
+	switch (req) {
+	case VREQ_GET_CFG:
+		// may straddle a change from the main loop; the host can just re-read
+		if (*len < CFGBLOB_LEN) break;
+		cfg_snapshot(buf);
+		*len = CFGBLOB_LEN;
+		return 0;
+	case VREQ_SET_CFG:
+		if (vreq.cfg_pending || (*len != CFGBLOB_LEN) || cfg_check(buf)) break;
+		memcpy(vreq.cfg, buf, CFGBLOB_LEN);
+		vreq.cfg_pending = 1;
+		return 0;
+	case VREQ_GET_STATUS:
+		if (*len < VREQ_STATUS_LEN) break;
+		sys_getstats(&rx_ovf, &tx_ovf);
+		buf[0] = (srq_state() ? VST_SRQ : 0) |
+			(gpib_cfg.controller_mode ? VST_CONTROLLER : 0) |
+			(gpib_cfg.device_talk ? VST_TALK : 0) |
+			(gpib_cfg.device_listen ? VST_LISTEN : 0) |
+			(listen_only ? VST_LON : 0);
+		buf[1] = gpib_cfg.controller_mode ? status_byte : demu.stb[demu.sel];
+		buf[2] = gpib_cfg.partnerAddress;
+		buf[3] = 0;
+		buf[4] = rx_ovf & 0xFF;
+		buf[5] = (rx_ovf >> 8) & 0xFF;
+		buf[6] = tx_ovf & 0xFF;
+		buf[7] = (tx_ovf >> 8) & 0xFF;
+		*len = VREQ_STATUS_LEN;
+		return 0;
+	case VREQ_SET_STB:
+		if (vreq.stb_pending) break;
+		vreq.stb = wValue & 0xFF;
+		vreq.stb_pending = 1;
+		return 0;
+	default:
+		break;
 	}
+	return -1;
+}
 
-	//build chunk from FIFO
-	if (!ecbuff_read(fifo_in, &rxb)) {
-		//no data
-		return;
+/** apply changes received by cmd_vendor_request() */
+static void vreq_poll(void) {
+	if (vreq.cfg_pending) {
+		cfg_apply(vreq.cfg);
+		vreq.cfg_pending = 0;
 	}
-	if (in_len == 0) {
-		if (rxb == '+') {
-			//start of new command chunk
-			in_cmd = 1;
-			cmd_len = 0;
-			has_args = 0;
-			arg_pos = 0;
-		} else {
-			//data chunk
-			in_cmd = 0;
+	if (vreq.stb_pending) {
+		if (!gpib_cfg.controller_mode) {
+			set_status(vreq.stb);
 		}
+		vreq.stb_pending = 0;
 	}
+}
+
+/**** macros
+ *
+ * "++mdef <name>" records the following lines (commands or data) into flash,
+ * until "++mend". "++run <name> [<arg1> ...]" then replays them through the
+ * normal command / data paths, with $1..$9 replaced by the args.
+ * Lines "++loop <n>" and "++endloop" repeat a block (one level; n=0 : until host abort).
+ *
+ * Each stored line starts with its chunk type (MLINE_*) : data lines are stored
+ * unescaped, so the first character can't tell. Commands keep their escapes.
+ */
+#define MACRO_LINEMAX	96
+#define MACRO_MAXDEPTH	2   //nested ++run
+#define MACRO_MAXARGS	9
+
+#define MLINE_CMD	'c'
+#define MLINE_DATA	'd'
+
+static unsigned macro_depth = 0;
 
-	if (wait_guardbyte) {
-		//just finished a chunk; make sure it was valid
-		wait_guardbyte = 0;
-		if (rxb != CHUNK_VALID) {
-			//discard
-			in_len = 0;
+/** @return 1 if cmd is "++mend", ignoring trailing blanks */
+static bool is_mend(const char *cmd, unsigned len) {
+	while (len && ((cmd[len - 1] == ' ') || (cmd[len - 1] == '\t'))) {
+		len--;
+	}
+	return (len == 6) && !memcmp(cmd, "++mend", 6);
+}
+
+/** append one line, two segments if it wraps */
+static void macro_line(u8 type, const u8 *data0, unsigned len0, const u8 *data1, unsigned len1) {
+	if (macro_append(&type, 1, 0) ||
+		macro_append(data0, len0, !len1) ||
+		(len1 && macro_append(data1, len1, 1))) {
+		printf("macro store full\n");
+	}
+}
+
+/** store chunk into macro being recorded.
+ * "++mend", alone or as a command of a ";++" batch, ends recording; the
+ * commands before it are recorded, the ones after it run as usual.
+ */
+static void macro_record(const struct rx_chunk *chunk) {
+	unsigned seg;
+
+	if (chunk->type == CHUNK_CMD) {
+		char *line = (char *) chunk->data[0];
+		unsigned len = chunk->len[0];
+		char *cmd = line;
+
+		while (cmd) {
+			unsigned left = len - (cmd - line);
+			char *sep = find_cmdsep(cmd, left);
+
+			if (is_mend(cmd, sep ? (unsigned) (sep - cmd) : left)) {
+				if (cmd != line) {
+					//up to the ';' before "++mend"
+					macro_line(MLINE_CMD, (u8 *) line, (cmd - 1) - line, NULL, 0);
+				}
+				if (macro_end()) {
+					printf("macro error\n");
+				}
+				if (sep) {
+					chunk_cmdline(sep + 1, len - ((sep + 1) - line));
+				}
+				return;
+			}
+			cmd = sep ? sep + 1 : NULL;
+		}
+	}
+	if (!(chunk->len[0] + chunk->len[1])) {
+		return;
+	}
+	for (seg = 0; seg < 2; seg++) {
+		if (memchr(chunk->data[seg], '\n', chunk->len[seg]) ||
+			memchr(chunk->data[seg], '\r', chunk->len[seg])) {
+			printf("macro: CR/LF in data not supported, line skipped\n");
 			return;
 		}
-		if (in_cmd) {
-			if (arg_pos) {
-				//non-empty args
-				chunk_cmd((char *) input_buf, cmd_len, 1);
+	}
+	macro_line((chunk->type == CHUNK_CMD) ? MLINE_CMD : MLINE_DATA,
+			   chunk->data[0], chunk->len[0], chunk->data[1], chunk->len[1]);
+}
+
+/** copy macro line, replacing $1..$9 with args
+ * @return length, or -1 if too long
+ */
+static int macro_expand(char *dst, const char *src, unsigned len,
+						const char * const *argv, const unsigned *argl, unsigned argc) {
+	unsigned o = 0;
+	unsigned i;
+
+	for (i = 0; i < len; i++) {
+		const char *s = &src[i];
+		unsigned sl = 1;
+		if ((src[i] == '$') && ((i + 1) < len) && (src[i + 1] >= '1') && (src[i + 1] <= '9')) {
+			unsigned an = src[++i] - '1';
+			s = (an < argc) ? argv[an] : "";
+			sl = (an < argc) ? argl[an] : 0;
+		}
+		if ((o + sl) >= MACRO_LINEMAX) {
+			return -1;
+		}
+		memcpy(&dst[o], s, sl);
+		o += sl;
+	}
+	dst[o] = 0;
+	return o;
+}
+
+void do_run(const char *args) {
+	// ++run <name> [<arg1> ... <arg9>]
+	const char *argv[MACRO_MAXARGS];
+	unsigned argl[MACRO_MAXARGS];
+	unsigned argc = 0;
+	char line[MACRO_LINEMAX];
+	const char *loop_start = NULL;
+	unsigned loop_left = 0;
+	unsigned blen;
+
+	const char *body = macro_find(args, strcspn(args, " "), &blen);
+	if (!body || (macro_depth >= MACRO_MAXDEPTH)) {
+		return;
+	}
+	for (args = next_arg(args); *args && (argc < MACRO_MAXARGS); args = next_arg(args)) {
+		argv[argc] = args;
+		argl[argc] = strcspn(args, " ");
+		argc++;
+	}
+
+	macro_depth++;
+	const char *p = body;
+	const char *end = body + blen;
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (!eol || (eol == p)) break;
+		u8 type = *p;
+		int len = macro_expand(line, p + 1, eol - (p + 1), argv, argl, argc);
+		p = eol + 1;
+
+		restart_wdt();
+		if (host_abort_pending()) {
+			break;
+		}
+		if ((len <= 0) || ((type != MLINE_CMD) && (type != MLINE_DATA))) {
+			continue;
+		}
+		if (type == MLINE_DATA) {
+			struct rx_chunk chunk = {
+				.data = {(u8 *) line, NULL},
+				.len = {len, 0},
+				.type = CHUNK_DATA,
+			};
+			chunk_data(&chunk);
+			continue;
+		}
+		if (!strncmp(line, "++loop", 6) && ((line[6] == ' ') || !line[6])) {
+			const char *cnt = next_arg(line);
+			if ((*cnt < '0') || (*cnt > '9')) {
+				printf("bad loop count\n");
+				break;
+			}
+			loop_start = p;
+			loop_left = atoi(cnt);
+			continue;
+		}
+		if (!strcmp(line, "++endloop")) {
+			if (loop_start && ((loop_left == 0) || (--loop_left > 0))) {
+				p = loop_start;
 			} else {
-				chunk_cmd((char *) input_buf, cmd_len, 0);
+				loop_start = NULL;
 			}
-		} else {
-			chunk_data((char *) input_buf, in_len);
+			continue;
 		}
-		in_len = 0;
+		chunk_cmdline(line, len);
+	}
+	macro_depth--;
+}
+
+void do_mdef(const char *args) {
+	// ++mdef <name>
+	if (host_framed()) {
+		// frames aren't recorded, so "++mend" could never end it
+		host_reply_end(RS_EINVAL);
 		return;
 	}
+	if (macro_begin(args, strlen(args))) {
+		printf("macro error\n");
+	}
+}
 
-	if (!escape_next && (rxb == 27)) {
-		//regardless of chunk type (command or data),
-		//strip escape char
-		escape_next = 1;
+static void print_macro(const char *name, unsigned namelen, unsigned bodylen) {
+	printf("%.*s %u\n", namelen, name, bodylen);
+}
+
+void do_mlist(const char *args) {
+	// ++mlist : names and sizes, then free space
+	(void) args;
+	macro_walk(print_macro);
+	printf("free %u\n", macro_free());
+}
+
+void do_mdel(const char *args) {
+	// ++mdel {<name>|*}
+	if (!strcmp(args, "*")) {
+		macro_erase_all();
 		return;
 	}
+	macro_delete(args, strlen(args));
+}
 
-	if (in_cmd) {
-		if (!escape_next && (rxb == '\n')) {
-			//0-terminate.
-			wait_guardbyte = 1;
-			input_buf[in_len] = 0;
-			return;
+/** recover from host abort : drop queued input and unaddress the bus.
+ * A break also stops the scan, and pulses IFC if enabled. */
+static void cmd_abort(void) {
+	bool brk = host_abort_pending() & ABORT_BREAK;
+
+	DEBUG_PRINTF("host abort\n");
+	if (brk) {
+		//a closed port leaves the scan running, see scan_record()
+		scan.interval = 0;
+	}
+	macro_cancel();
+	if (gpib_cfg.controller_mode) {
+		if (brk && abort_ifc) {
+			pulse_ifc();
 		}
-		escape_next = 0;
-		//also, tokenize now instead of calling strtok later.
-		//Only split args once.
-		if (has_args) {
-			input_buf[in_len++] = rxb;
-			return;
+		gpib_unaddress();
+	}
+	host_abort_done();
+}
+
+void cmd_poll(void) {
+	struct rx_chunk chunk;
+	unsigned budget = HOST_IN_BUFSIZE;  //bound the time spent here if host keeps sending
+
+	vreq_poll();
+
+	while (!host_abort_pending() && host_rx_getchunk(&chunk)) {
+		unsigned len = chunk.len[0] + chunk.len[1];
+
+		if (chunk.flags & CHUNK_F_OVERFLOW) {
+			DEBUG_PRINTF("host input overflow, data lost\n");
 		}
-		if (rxb == ' ') {
-			cmd_len = in_len;
-			//commands of form "++<cmd> <args>": split args on ' '
-			input_buf[in_len++] = 0;
-			has_args = 1;
-			arg_pos = in_len;
+		if (macro_recording() && (chunk.type != CHUNK_FRAME)) {
+			macro_record(&chunk);
+		} else if (chunk.type == CHUNK_CMD) {
+			chunk_cmdline((char *) chunk.data[0], len);
+		} else if (chunk.type == CHUNK_FRAME) {
+			chunk_frame(&chunk);
 		} else {
-			input_buf[in_len++] = rxb;
-			cmd_len++;
+			chunk_data(&chunk);
 		}
+		host_rx_release();
 
-		return;
+		if (len >= budget) {
+			break;
+		}
+		budget -= len + 1;
 	}
-
-	// if we made it here, we're dealing with data.
-	if (!escape_next && (rxb == '\n')) {
-		//terminate.
-		wait_guardbyte = 1;
-		return;
+	if (host_abort_pending()) {
+		cmd_abort();
 	}
-	input_buf[in_len++] = rxb;
-	escape_next = 0;
+}
 
-	return;
+
+void dev_poll(void) {
+	if (listen_only) {
+		listenonly();
+	} else if (!gpib_cfg.controller_mode) {
+		device_poll();
+	}
 }
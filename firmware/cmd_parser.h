@@ -1,13 +1,60 @@
 #ifndef _CMD_PARSER_H
 #define _CMD_PARSER_H
 
-/** wait for command inputs, or GPIB traffic if in device mode
+#include <stdint.h>
+
+/** parse and run command inputs
  *
  * Assumes an interrupt-based process is feeding the input FIFO.
+ * Every call drains and dispatches (up to a FIFO's worth of) pending data.
  * This func must be called in a loop
  */
 void cmd_poll(void);
 
+/** handle GPIB traffic in device mode or listen-only mode
+ *
+ * Does nothing in controller mode.
+ * This func must be called in a loop, independently of cmd_poll()
+ */
+void dev_poll(void);
+
+/** run the autonomous scan list (++scan) when due
+ *
+ * Does nothing unless a scan is active, in controller mode.
+ * This func must be called in a loop
+ */
+void scan_poll(void);
+
+/** EP0 vendor requests (bmRequestType : vendor, device).
+ * Side channel that doesn't go through the bulk data FIFOs.
+ */
+enum vendor_req {
+	VREQ_GET_CFG = 1,   //IN : ++cfg snapshot, binary
+	VREQ_SET_CFG = 2,   //OUT : ++cfg snapshot, binary. Stalls if invalid
+	VREQ_GET_STATUS = 3,    //IN : VREQ_STATUS_LEN bytes, see below
+	VREQ_SET_STB = 4,   //wValue : status byte, like ++status (device mode)
+};
+
+/* VREQ_GET_STATUS reply :
+ * [0] flags VST_*, [1] status byte, [2] partnerAddress, [3] reserved
+ * [4..5] rx_ovf, [6..7] tx_ovf (LE, 16 lsbits)
+ */
+#define VREQ_STATUS_LEN	8
+#define VST_SRQ	(1 << 0)    //SRQ asserted on bus
+#define VST_CONTROLLER	(1 << 1)
+#define VST_TALK	(1 << 2)    //device mode : addressed to talk
+#define VST_LISTEN	(1 << 3)    //device mode : addressed to listen
+#define VST_LON	(1 << 4)
+
+/** handle vendor request. Called in USB ISR context
+ *
+ * Reads are served immediately; changes are validated here, then applied
+ * from cmd_poll().
+ * @param buf control buffer : request data (OUT), or reply (IN)
+ * @param len in : wLength; out : reply length
+ * @return 0 if ok, otherwise the request should be stalled
+ */
+int cmd_vendor_request(uint8_t req, uint16_t wValue, uint8_t *buf, uint16_t *len);
 
 /** initialize command parser
  *
@@ -16,6 +16,8 @@
 #include "cmd_parser.h"
 #include "host_comms.h"
 #include "usb_cdc.h"
+#include "cfg_store.h"
+#include "macro_store.h"
 
 #include "gpib.h"
 
@@ -31,8 +33,8 @@ int main(void)
 
 	setControls(DINI);  //should be safe default
 
-	// TODO: Load settings from EEPROM
-
+	cfg_store_init();
+	macro_store_init();
 	host_comms_init();
 	cmd_parser_init();
 
@@ -41,7 +43,10 @@ int main(void)
 
 	while (1) {
 		restart_wdt();
+		host_comms_poll();
 		cmd_poll();
+		dev_poll();
+		scan_poll();
 		led_poll();
 	}
 
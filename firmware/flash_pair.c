@@ -0,0 +1,79 @@
+/* Pair of flash pages used as an append-only log
+ *
+ * (c) fenugrec 2018-2021
+ * GPLv3
+ *
+ * See flash_pair.h for the page status scheme.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "flash_pair.h"
+#include "firmware.h"
+#include "hw_backend.h"
+
+#include "stypes.h"
+
+
+#define PS_ERASED	0xFFFF
+#define PS_RECEIVE	0xEEEE
+#define PS_VALID	0x0000
+
+
+void fpair_init(struct flash_pair *fp) {
+	u16 ps[2] = {FLASH16(FPAIR_ADDR(fp, 0)), FLASH16(FPAIR_ADDR(fp, 1))};
+	unsigned page;
+
+	for (page = 0; page < 2; page++) {
+		unsigned other = page ^ 1;
+		if ((ps[page] == PS_VALID) && (ps[other] != PS_VALID)) {
+			fp->page = page;
+			if (ps[other] != PS_ERASED) {
+				flash_erase(FPAIR_ADDR(fp, other));
+			}
+			return;
+		}
+	}
+	for (page = 0; page < 2; page++) {
+		unsigned other = page ^ 1;
+		if ((ps[page] == PS_RECEIVE) && (ps[other] != PS_VALID)) {
+			// copy was complete; old page may be partially erased
+			fp->page = page;
+			flash_erase(FPAIR_ADDR(fp, other));
+			flash_prog16(FPAIR_ADDR(fp, page), PS_VALID);
+			return;
+		}
+	}
+	// blank or corrupt
+	flash_erase(FPAIR_ADDR(fp, 1));
+	flash_erase(FPAIR_ADDR(fp, 0));
+	flash_prog16(FPAIR_ADDR(fp, 0), PS_VALID);
+	fp->page = 0;
+}
+
+uint32_t fpair_xfer_begin(struct flash_pair *fp) {
+	u32 addr = FPAIR_ADDR(fp, fp->page ^ 1);
+
+	if (flash_erase(addr) || flash_prog16(addr, PS_RECEIVE)) {
+		return 0;
+	}
+	return addr + FPAIR_HDRLEN;
+}
+
+enum errcodes fpair_xfer_end(struct flash_pair *fp) {
+	unsigned newpage = fp->page ^ 1;
+
+	if (flash_erase(FPAIR_ADDR(fp, fp->page))) {
+		// old page probably still VALID : it wins at boot
+		return E_FIFO;
+	}
+	// from here, the new page wins at boot even if the rest fails
+	fp->page = newpage;
+	return flash_prog16(FPAIR_ADDR(fp, newpage), PS_VALID);
+}
+
+void fpair_clear(struct flash_pair *fp) {
+	flash_erase(FPAIR_ADDR(fp, fp->page));
+	flash_prog16(FPAIR_ADDR(fp, fp->page), PS_VALID);
+}
@@ -0,0 +1,60 @@
+#ifndef _FLASH_PAIR_H
+#define _FLASH_PAIR_H
+
+/*
+ * Pair of flash pages used as an append-only log, for cfg_store.c and macro_store.c
+ *
+ * (c) fenugrec 2018-2021
+ * GPLv3
+ *
+ * Each page starts with a 16-bit status (+ 16-bit pad), then the owner's records.
+ * Page status only goes 1->0 : ERASED -> RECEIVE -> VALID.
+ * During a transfer, the new page is marked RECEIVE and filled, then the old page
+ * is erased, and only then is the new page marked VALID. At boot :
+ * - VALID + anything : use VALID page, erase the other if needed (interrupted transfer);
+ * - RECEIVE + no VALID : the copy had completed, finish the transfer;
+ * - otherwise : blank / corrupt store, format.
+ */
+
+#include <stdint.h>
+
+#include "firmware.h"
+
+#define FPAIR_HDRLEN	4	//offset of first record in page
+
+#define FLASH16(addr)	(*(volatile const uint16_t *) (addr))
+#define FLASH32(addr)	(*(volatile const uint32_t *) (addr))
+
+struct flash_pair {
+	uint32_t base;  //address of page 0; page 1 follows
+	unsigned pagesize;
+	unsigned page;  //active page, 0 or 1
+};
+
+#define FPAIR_ADDR(fp, n)	((fp)->base + ((n) * (fp)->pagesize))
+/** first record, and end of the active page */
+#define FPAIR_START(fp)	(FPAIR_ADDR(fp, (fp)->page) + FPAIR_HDRLEN)
+#define FPAIR_END(fp)	FPAIR_ADDR(fp, (fp)->page + 1)
+
+/** find the active page, finishing an interrupted transfer, or format the pair.
+ * The owner then scans the records of fp->page.
+ */
+void fpair_init(struct flash_pair *fp);
+
+/** start a transfer : erase the other page and mark it RECEIVE
+ * @return address of its first record, 0 if that failed
+ */
+uint32_t fpair_xfer_begin(struct flash_pair *fp);
+
+/** finish a transfer once all records were copied : erase the old page, and
+ * make the new one active and VALID.
+ * @return E_OK; otherwise fp->page tells which page is still in use
+ */
+enum errcodes fpair_xfer_end(struct flash_pair *fp);
+
+/** erase the active page and mark it VALID again. The other page is erased
+ * before its next use anyway.
+ */
+void fpair_clear(struct flash_pair *fp);
+
+#endif // _FLASH_PAIR_H
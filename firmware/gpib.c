@@ -62,7 +62,7 @@ struct gpib_config gpib_cfg = {
 	.eoiUse = 1,
 	.eot_char = '\n',
 	.eot_enable = 1,
-	.autoread = 1,
+	.autoread = AUTOREAD_ALWAYS,
 	.timeout = 2000,
 	.device_talk = false,
 	.device_listen = false,
@@ -92,6 +92,66 @@ enum errcodes gpib_cmd_m(const uint8_t *byte, unsigned len) {
 	return rv;
 }
 
+#define TIMED_IRQOFF_US 20   //mask interrupts this long before firing
+
+enum errcodes gpib_cmd_timed(uint8_t cmd, uint32_t t_fire, uint32_t *t_actual) {
+	enum errcodes rv = E_TIMEOUT;
+	u32 t0;
+	u32 tdelta = gpib_cfg.timeout;
+	bool irq;
+
+	setControls(CCMS);
+	dio_output();
+
+	// wait NDAC low : listeners present and done with previous byte
+	t0 = get_ms();
+	while (gpio_get(HCTRL1_CP, NDAC)) {
+		restart_wdt();
+		if (TS_ELAPSED(get_ms(),t0,tdelta) || host_abort_pending()) {
+			DEBUG_PRINTF("timed cmd: timeout waiting for NDAC-\n");
+			goto exit;
+		}
+	}
+	WRITE_DIO(cmd);
+
+	// wait NRFD high : listeners ready
+	while (!gpio_get(HCTRL1_CP, NRFD)) {
+		restart_wdt();
+		if (TS_ELAPSED(get_ms(),t0,tdelta) || host_abort_pending()) {
+			DEBUG_PRINTF("timed cmd: timeout waiting for NRFD+\n");
+			goto exit;
+		}
+	}
+
+	while ((int32_t) (t_fire - get_us32()) > TIMED_IRQOFF_US) {
+		restart_wdt();
+		if (host_abort_pending()) {
+			goto exit;
+		}
+	}
+	irq = disable_irq();
+	while ((int32_t) (t_fire - get_us32()) > 0) {}
+	assert_signal(HCTRL1_CP, DAV);
+	*t_actual = get_us32();
+	restore_irq(irq);
+
+	// wait NDAC high : all listeners accepted the byte
+	t0 = get_ms();
+	while (!gpio_get(HCTRL1_CP, NDAC)) {
+		restart_wdt();
+		if (TS_ELAPSED(get_ms(),t0,tdelta) || host_abort_pending()) {
+			DEBUG_PRINTF("timed cmd: timeout waiting for NDAC+\n");
+			goto exit;
+		}
+	}
+	rv = E_OK;
+exit:
+	unassert_signal(HCTRL1_CP, DAV);
+	dio_float();
+	setControls(CIDS);
+	return rv;
+}
+
 /** Write a GPIB data string to the GPIB bus.
 *
 * See _gpib_write for parameter information
@@ -137,7 +197,7 @@ static enum errcodes _gpib_write(const uint8_t *bytes, uint32_t length, bool use
 	while (!gpio_get(HCTRL1_CP, NRFD)) {
 		restart_wdt();
 		u32 now = get_ms();
-		if (TS_ELAPSED(now,t0,tdelta)) {
+		if (TS_ELAPSED(now,t0,tdelta) || host_abort_pending()) {
 			DEBUG_PRINTF("write: timeout: waiting for NRFD+\n");
 			goto wt_exit;
 		}
@@ -154,7 +214,7 @@ static enum errcodes _gpib_write(const uint8_t *bytes, uint32_t length, bool use
 		while (gpio_get(HCTRL1_CP, NDAC)) {
 			restart_wdt();
 			u32 now = get_ms();
-			if (TS_ELAPSED(now,t0,tdelta)) {
+			if (TS_ELAPSED(now,t0,tdelta) || host_abort_pending()) {
 				DEBUG_PRINTF("write timeout: waiting for NDAC-\n");
 				goto wt_exit;
 			}
@@ -172,7 +232,7 @@ static enum errcodes _gpib_write(const uint8_t *bytes, uint32_t length, bool use
 		while (!gpio_get(HCTRL1_CP, NRFD)) {
 			restart_wdt();
 			u32 now = get_ms();
-			if (TS_ELAPSED(now,t0,tdelta)) {
+			if (TS_ELAPSED(now,t0,tdelta) || host_abort_pending()) {
 				DEBUG_PRINTF("write timeout: Waiting for NRFD+\n");
 				goto wt_exit;
 			}
@@ -185,7 +245,7 @@ static enum errcodes _gpib_write(const uint8_t *bytes, uint32_t length, bool use
 		while (!gpio_get(HCTRL1_CP, NDAC)) {
 			restart_wdt();
 			u32 now = get_ms();
-			if (TS_ELAPSED(now,t0,tdelta)) {
+			if (TS_ELAPSED(now,t0,tdelta) || host_abort_pending()) {
 				DEBUG_PRINTF("write timeout: Waiting for NDAC+\n");
 				goto wt_exit;
 			}
@@ -229,7 +289,7 @@ enum errcodes gpib_read_byte(uint8_t *byte, bool *eoi_status) {
 	while (gpio_get(HCTRL1_CP, DAV)) {
 		restart_wdt();
 		u32 now = get_ms();
-		if (TS_ELAPSED(now,t0,tdelta)) {
+		if (TS_ELAPSED(now,t0,tdelta) || host_abort_pending()) {
 			DEBUG_PRINTF("readbyte timeout: Waiting for DAV-\n");
 			goto rt_exit;
 		}
@@ -251,7 +311,7 @@ enum errcodes gpib_read_byte(uint8_t *byte, bool *eoi_status) {
 	while (!gpio_get(HCTRL1_CP, DAV)) {
 		restart_wdt();
 		u32 now = get_ms();
-		if (TS_ELAPSED(now,t0,tdelta)) {
+		if (TS_ELAPSED(now,t0,tdelta) || host_abort_pending()) {
 			DEBUG_PRINTF("readbyte timeout: Waiting for DAV+\n");
 			goto rt_exit;
 		}
@@ -273,6 +333,12 @@ rt_exit:
 *
 * Returns 0 if everything went fine, or 1 if there was an error
 */
+static enum gpib_readend read_end = READEND_EOI;
+
+enum gpib_readend gpib_read_end(void) {
+	return read_end;
+}
+
 enum errcodes gpib_read(enum gpib_readmode readmode,
 						uint8_t eos_char,
 						bool eot_enable) {
@@ -295,6 +361,7 @@ enum errcodes gpib_read(enum gpib_readmode readmode,
 
 	dio_float();
 
+	read_end = READEND_TMO;
 	// TODO : what happens if device keeps sending data, or never sends EOI/EOS ?
 	switch (readmode) {
 	case GPIBREAD_EOI:
@@ -307,10 +374,12 @@ enum errcodes gpib_read(enum gpib_readmode readmode,
 			host_tx(byte);
 			if (eoi_status) {
 				//all done
+				read_end = READEND_EOI;
 				break;
 			}
-			if (host_rx_datapresent()) {
+			if (host_rx_datapresent() || host_abort_pending()) {
 				DEBUG_PRINTF("gpr interrupted\n");
+				read_end = READEND_ABORT;
 				break;
 			}
 		} while (1);
@@ -325,10 +394,12 @@ enum errcodes gpib_read(enum gpib_readmode readmode,
 			// Check to see if the byte we just read is the specified EOS byte
 			if (byte == eos_char) {
 				//all done
+				read_end = READEND_EOS;
 				break;
 			}
-			if (host_rx_datapresent()) {
+			if (host_rx_datapresent() || host_abort_pending()) {
 				DEBUG_PRINTF("gpr interrupted\n");
+				read_end = READEND_ABORT;
 				break;
 			}
 			// XXX TODO : is it necessary to strip CR+LF if eos_char is CR (or LF) ?
@@ -336,6 +407,24 @@ enum errcodes gpib_read(enum gpib_readmode readmode,
 			host_tx(byte);
 		} while (1);
 		break;
+	case GPIBREAD_EOI_EOS:
+		do {
+			if (gpib_read_byte(&byte, &eoi_status)) {
+				DEBUG_PRINTF("gpr EOI/EOS:E\n");
+				goto e_timeout;
+			}
+			host_tx(byte);
+			if (eoi_status || (byte == eos_char)) {
+				read_end = eoi_status ? READEND_EOI : READEND_EOS;
+				break;
+			}
+			if (host_rx_datapresent() || host_abort_pending()) {
+				DEBUG_PRINTF("gpr interrupted\n");
+				read_end = READEND_ABORT;
+				break;
+			}
+		} while (1);
+		break;
 	case GPIBREAD_TMO:
 		// TODO : large timeout incase device never stops writing ? do we care ?
 		do {
@@ -345,8 +434,9 @@ enum errcodes gpib_read(enum gpib_readmode readmode,
 				continue;
 			}
 			DEBUG_PRINTF("gpr TMO:E\n");
-			if (host_rx_datapresent()) {
+			if (host_rx_datapresent() || host_abort_pending()) {
 				DEBUG_PRINTF("gpr interrupted\n");
+				read_end = READEND_ABORT;
 				break;
 			}
 			// E_TIMEOUT or other errors (no such thing yet)
@@ -368,12 +458,221 @@ enum errcodes gpib_read(enum gpib_readmode readmode,
 	return error_found;
 
 e_timeout:
+	if (host_abort_pending()) {
+		read_end = READEND_ABORT;
+	}
 	setControls(next_state);
 	return E_TIMEOUT;
 }
 
 
 
+enum errcodes gpib_read_buf(uint8_t *buf, unsigned *len, int eos_char) {
+	uint8_t byte;
+	bool eoi_status;
+	unsigned bufsize = *len;
+	unsigned cnt = 0;
+	enum errcodes rv = E_OK;
+
+	setControls(CLAS);
+	dio_float();
+
+	do {
+		if (gpib_read_byte(&byte, &eoi_status)) {
+			DEBUG_PRINTF("gpr buf:E\n");
+			rv = E_TIMEOUT;
+			break;
+		}
+		if (cnt < bufsize) {
+			buf[cnt++] = byte;
+		} else {
+			rv = E_FIFO;
+		}
+	} while (!eoi_status && (byte != eos_char));
+
+	*len = cnt;
+	setControls(CIDS);
+	return rv;
+}
+
+/** end of a device mode transfer. If ATN is asserted, keep holding off the
+ * controller (NRFD + NDAC) like bus_isr() does, until device_atn() runs.
+ */
+static void device_idle(void) {
+	if (!gpio_get(HCTRL2_CP, ATN) && !bus_ifc_seen(0)) {
+		setControls(DLAS);
+		dio_float();
+		assert_signal(HCTRL1_CP, NRFD | NDAC);
+	} else {
+		setControls(DIDS);
+	}
+}
+
+/** send byte to host, waiting for room while the controller keeps us addressed
+ *
+ * @return 0 if the wait was cut short : ATN, IFC, abort request (host closed the port...) or timeout
+ */
+static bool device_tx(u8 txb) {
+	u32 t0 = get_ms();
+
+	while (!host_tx_try(txb)) {
+		restart_wdt();
+		u32 now = get_ms();
+		if (!gpio_get(HCTRL2_CP, ATN) || bus_ifc_seen(0) ||
+			TS_ELAPSED(now, t0, gpib_cfg.timeout) || host_abort_pending()) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+enum gpib_readend gpib_device_listen(bool eot_enable, uint8_t *cap, unsigned capsize, unsigned *caplen) {
+	u8 byte;
+	bool eoi_status;
+	u32 t0;
+
+	dio_float();
+	setControls(DLAS);
+	assert_signal(HCTRL1_CP, NDAC);
+
+	while (1) {
+		// ready for next byte
+		unassert_signal(HCTRL1_CP, NRFD);
+
+		t0 = get_ms();
+		while (gpio_get(HCTRL1_CP, DAV)) {
+			restart_wdt();
+			if (!gpio_get(HCTRL2_CP, ATN) || bus_ifc_seen(0) ||
+				host_rx_datapresent() || host_abort_pending()) {
+				read_end = READEND_ABORT;
+				goto exit;
+			}
+			u32 now = get_ms();
+			if (TS_ELAPSED(now, t0, gpib_cfg.timeout)) {
+				// no data for a while : let the main loop run. Still addressed
+				read_end = READEND_TMO;
+				goto exit;
+			}
+		}
+		assert_signal(HCTRL1_CP, NRFD);
+		byte = READ_DIO();
+		eoi_status = !gpio_get(EOI_CP, EOI);
+		unassert_signal(HCTRL1_CP, NDAC);
+
+		if (*caplen < capsize) {
+			cap[*caplen] = byte;
+		}
+		(*caplen)++;
+
+		// waits while fifo_out is full; NRFD stays asserted meanwhile
+		if (!device_tx(byte) ||
+			(eoi_status && eot_enable && !device_tx(gpib_cfg.eot_char))) {
+			read_end = READEND_ABORT;
+			goto exit;
+		}
+
+		t0 = get_ms();
+		while (!gpio_get(HCTRL1_CP, DAV)) {
+			restart_wdt();
+			u32 now = get_ms();
+			if (TS_ELAPSED(now, t0, gpib_cfg.timeout) || host_abort_pending()) {
+				read_end = READEND_TMO;
+				goto exit;
+			}
+		}
+		assert_signal(HCTRL1_CP, NDAC);
+
+		if (eoi_status) {
+			read_end = READEND_EOI;
+			break;
+		}
+	}
+
+exit:
+	assert_signal(HCTRL1_CP, NRFD);
+	device_idle();
+	return read_end;
+}
+
+enum errcodes gpib_device_cmd(uint8_t *cmd) {
+	enum errcodes rv = E_TIMEOUT;
+	u32 t0;
+
+	setControls(DLAS);
+	dio_float();
+	assert_signal(HCTRL1_CP, NDAC);
+	unassert_signal(HCTRL1_CP, NRFD);
+
+	t0 = get_ms();
+	while (gpio_get(HCTRL1_CP, DAV)) {
+		restart_wdt();
+		u32 now = get_ms();
+		if (gpio_get(HCTRL2_CP, ATN) || bus_ifc_seen(0) ||
+			TS_ELAPSED(now, t0, gpib_cfg.timeout) || host_abort_pending()) {
+			goto exit;
+		}
+	}
+	assert_signal(HCTRL1_CP, NRFD);
+	*cmd = READ_DIO();
+	unassert_signal(HCTRL1_CP, NDAC);
+
+	while (!gpio_get(HCTRL1_CP, DAV)) {
+		restart_wdt();
+		u32 now = get_ms();
+		if (bus_ifc_seen(0) || TS_ELAPSED(now, t0, gpib_cfg.timeout) || host_abort_pending()) {
+			break;
+		}
+	}
+	rv = E_OK;
+
+exit:
+	device_idle();
+	return rv;
+}
+
+unsigned gpib_device_talk(const uint8_t *bytes, unsigned len, bool use_eoi) {
+	unsigned i;
+	u32 t0;
+
+	setControls(DTAS);
+	dio_output();
+	for (i = 0; i < len; i++) {
+		// previous byte done (NDAC low), and listeners ready (NRFD high)
+		t0 = get_ms();
+		while (gpio_get(HCTRL1_CP, NDAC) || !gpio_get(HCTRL1_CP, NRFD)) {
+			restart_wdt();
+			u32 now = get_ms();
+			if (!gpio_get(HCTRL2_CP, ATN) || bus_ifc_seen(0) ||
+				TS_ELAPSED(now, t0, gpib_cfg.timeout) || host_abort_pending()) {
+				goto exit;
+			}
+		}
+		WRITE_DIO(bytes[i]);
+		if (use_eoi && (i == (len - 1))) {
+			assert_signal(EOI_CP, EOI);
+		}
+		assert_signal(HCTRL1_CP, DAV);
+
+		// wait until all listeners accepted the byte
+		while (!gpio_get(HCTRL1_CP, NDAC)) {
+			restart_wdt();
+			u32 now = get_ms();
+			if (!gpio_get(HCTRL2_CP, ATN) || bus_ifc_seen(0) ||
+				TS_ELAPSED(now, t0, gpib_cfg.timeout) || host_abort_pending()) {
+				unassert_signal(HCTRL1_CP, DAV);
+				goto exit;
+			}
+		}
+		unassert_signal(HCTRL1_CP, DAV);
+	}
+
+exit:
+	unassert_signal(EOI_CP, EOI);
+	dio_float();
+	device_idle();
+	return i;
+}
+
 void gpib_unaddress(void) {
 	const uint8_t cmdbuf[] = { CMD_UNT, CMD_UNL };
 	(void) gpib_cmd_m(cmdbuf, sizeof(cmdbuf));
@@ -397,6 +696,24 @@ enum errcodes gpib_address_target(uint32_t address, enum addr_dir dir) {
 	return gpib_cmd_m(cmdbuf, sizeof(cmdbuf));
 }
 
+enum errcodes gpib_address_list(const struct gpib_addrlist *al, enum addr_dir dir) {
+	u8 cmdbuf[2 + 2 * GPIB_MAXLISTENERS] = {CMD_UNT, CMD_UNL};
+	unsigned len = 2;
+	unsigned n = al->n;
+	unsigned i;
+
+	if (dir == DEV_TALK) {
+		n = 1;
+	}
+	for (i = 0; (i < n) && (i < GPIB_MAXLISTENERS); i++) {
+		cmdbuf[len++] = al->pad[i] + ((dir == CTRL_TALK) ? CMD_LAD : CMD_TAD);
+		if (al->sad[i]) {
+			cmdbuf[len++] = al->sad[i];
+		}
+	}
+	return gpib_cmd_m(cmdbuf, len);
+}
+
 
 void pulse_ifc(void) {
 	assert_signal(HCTRL2_CP, IFC);
@@ -425,11 +742,12 @@ uint32_t gpib_controller_assign(void) {
 
 /** conduct serial poll
  *
+ * @param sad secondary address (CMD_SAD + n), 0 if none
  * @param status_byte poll result will be written there
  *
  * @return 0 if OK
  */
-uint32_t gpib_serial_poll(int address, u8 *status_byte) {
+uint32_t gpib_serial_poll(int address, u8 sad, u8 *status_byte) {
 	char error = 0;
 	u8 cmd;
 	bool eoistat = 0;
@@ -437,6 +755,9 @@ uint32_t gpib_serial_poll(int address, u8 *status_byte) {
 	error = error || gpib_cmd(CMD_SPE);
 	cmd = address + CMD_TAD;
 	error = error || gpib_cmd(cmd);
+	if (sad) {
+		error = error || gpib_cmd(sad);
+	}
 	if (error) return -1;
 
 	dio_float();
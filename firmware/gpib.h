@@ -49,6 +49,24 @@ enum addr_dir {
 	DEV_TALK
 };
 
+#define GPIB_MAXLISTENERS	15
+
+/** group of devices, addressed in one ATN session */
+struct gpib_addrlist {
+	uint8_t n;
+	uint8_t pad[GPIB_MAXLISTENERS];
+	uint8_t sad[GPIB_MAXLISTENERS];	//secondary address (CMD_SAD + n), 0 if none
+};
+
+/** when to read back after writing data (++auto) */
+enum autoread_mode {
+	AUTOREAD_OFF = 0,
+	AUTOREAD_ALWAYS = 1,
+	AUTOREAD_QUERY = 2, //only after IEEE 488.2 queries ('?' in a program header)
+	AUTOREAD_QUERY_MAV = 3, //after queries, or if a serial poll shows MAV
+	AUTOREAD_MAX = AUTOREAD_QUERY_MAV
+};
+
 enum eos_codes {
 	EOS_CRLF = 0,
 	EOS_LF = 1,
@@ -60,6 +78,16 @@ enum eos_codes {
 
 enum errcodes gpib_cmd(const uint8_t byte);
 enum errcodes gpib_cmd_m(const uint8_t *byte, unsigned len);
+
+/** Write a GPIB command byte with precisely timed DAV
+ *
+ * The handshake is prepared ahead (ATN, data lines, wait for NRFD), then DAV is
+ * asserted once get_us32() reaches t_fire, with interrupts masked for the last few us.
+ * Should be called shortly before t_fire : ATN stays asserted while waiting.
+ *
+ * @param t_actual get_us32() timestamp when DAV was asserted (can be late if listeners were slow)
+ */
+enum errcodes gpib_cmd_timed(uint8_t cmd, uint32_t t_fire, uint32_t *t_actual);
 enum errcodes gpib_write(const uint8_t *bytes, uint32_t length, bool use_eoi);
 enum errcodes gpib_read_byte(uint8_t *byte, bool *eoi_status);
 
@@ -68,24 +96,82 @@ enum gpib_readmode {
 	GPIBREAD_EOI,
 	GPIBREAD_EOS,   //after specified char
 	GPIBREAD_TMO,   //after timeout
+	GPIBREAD_EOI_EOS,   //after EOI or specified char (which is kept), whichever comes first
 };
 enum errcodes gpib_read(enum gpib_readmode, uint8_t eos_char, bool eot_enable);
 
+/** how the last gpib_read() ended */
+enum gpib_readend {
+	READEND_EOI,
+	READEND_EOS,    //EOS char seen
+	READEND_TMO,    //timeout (normal end for GPIBREAD_TMO)
+	READEND_ABORT,  //interrupted by host data or abort
+};
+enum gpib_readend gpib_read_end(void);
+
+/** read into a buffer instead of sending to host.
+ *
+ * Reads until EOI, or until eos_char (which is kept).
+ * @param len in: buffer size; out: number of bytes stored. Extra data is discarded.
+ * @param eos_char if < 0, read until EOI only
+ * @return E_OK, E_TIMEOUT, or E_FIFO if data didn't fit
+ */
+enum errcodes gpib_read_buf(uint8_t *buf, unsigned *len, int eos_char);
+
+/** device mode : accept data while listen-addressed, and stream it to the host.
+ *
+ * Output to the host blocks while fifo_out is full, holding off the talker,
+ * so captures are lossless.
+ * @param cap received bytes are also stored here, up to capsize
+ * @param caplen incremented for every byte received, even past capsize
+ * @return READEND_EOI at end of message; READEND_ABORT when ATN is asserted or on
+ * host input / abort; READEND_TMO after gpib_cfg.timeout without data.
+ * Listen state is unchanged.
+ */
+enum gpib_readend gpib_device_listen(bool eot_enable, uint8_t *cap, unsigned capsize, unsigned *caplen);
+
+/** device mode : accept one command byte while ATN is asserted.
+ *
+ * While ATN stays asserted, NRFD and NDAC are left asserted so the controller
+ * waits for the next call.
+ * @return E_OK, or E_TIMEOUT if ATN was released, on IFC, or no byte came in time.
+ * Talk / listen state is unchanged.
+ */
+enum errcodes gpib_device_cmd(uint8_t *cmd);
+
+/** device mode : send data while talk-addressed.
+ *
+ * Stops as soon as ATN is asserted (the controller takes the bus back), on timeout
+ * or host abort. Talk state is unchanged.
+ * @param use_eoi assert EOI with the last byte
+ * @return number of bytes accepted by the listeners
+ */
+unsigned gpib_device_talk(const uint8_t *bytes, unsigned len, bool use_eoi);
+
 /** assumes states are correct */
 void pulse_ifc(void);
 
 enum errcodes gpib_address_target(uint32_t address, enum addr_dir dir);
 
+/** address a device group
+ *
+ * Sends UNT, UNL, then LAD (+SAD) of every device with CTRL_TALK,
+ * or TAD (+SAD) of the first device with DEV_TALK.
+ */
+enum errcodes gpib_address_list(const struct gpib_addrlist *al, enum addr_dir dir);
+
 // Untalk and Unlisten all
 void gpib_unaddress(void);
 uint32_t gpib_controller_assign(void);
-uint32_t gpib_serial_poll(int address, uint8_t *status_byte);
+/** @param sad secondary address (CMD_SAD + n), 0 if none */
+uint32_t gpib_serial_poll(int address, uint8_t sad, uint8_t *status_byte);
 
 #define CMD_DCL 0x14
 #define CMD_LAD 0x20
 #define CMD_UNL 0x3f
 #define CMD_TAD 0x40
 #define CMD_UNT 0x5f
+#define CMD_SAD 0x60
 #define CMD_GET 0x8
 #define CMD_SDC 0x04
 #define CMD_LLO 0x11
@@ -102,7 +188,7 @@ struct gpib_config {
 	bool eot_enable;
 	char eos_code;
 	bool eoiUse;
-	bool autoread;
+	uint8_t autoread;   //enum autoread_mode
 	uint32_t timeout;   //in milliseconds
 	int partnerAddress;
 	int myAddress;
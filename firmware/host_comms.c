@@ -5,15 +5,20 @@
  *
  * The RX channel (receiving from host) needs a FIFO buffer
  *
- * To simplify the command parser, we do some initial filtering
+ * The USB interrupt only queues raw packets. To simplify the command parser,
+ * we then do some initial filtering from the main loop,
  * according to state and received length.
  *
  * Once a complete chunk (either command
- * or data) is received, it gets copied to a command buffer to be
- * parsed by the cmd_parser.
+ * or data) is received, a descriptor is queued and the cmd_parser
+ * gets to work on it directly inside the ring (see host_rx_getchunk()).
  */
 
 #include <stdint.h>
+#include <string.h>
+
+#include "printf_config.h"  //hax, just to get PRINTF_ALIAS_STANDARD_FUNCTION_NAMES...
+#include <printf/printf.h>
 
 #include "hw_backend.h"
 #include "host_comms.h"
@@ -26,105 +31,561 @@
 /**** globals */
 
 
-/* incoming data is saved into the input FIFO, after
- * minimal filtering, length check
- * and overflow recovery.
+/* raw packets from host, filled by the USB ISR */
+static _Alignas(ecbuff) uint8_t pktq_buf[sizeof(ecbuff) + HOST_RX_PACKETS * sizeof(struct rx_packet)];
+static ecbuff *pktq = (ecbuff *) pktq_buf;
+static unsigned pkt_pos;    //bytes of oldest packet already filtered
+
+/* incoming data is unescaped once and saved into the input ring, after
+ * minimal filtering, length check and overflow recovery.
+ * Completed chunks are then published in chunkq.
+ *
+ * Commands never wrap around the end of the ring, so they can be parsed in place;
+ * see chunk_putn().
  */
-static _Alignas(ecbuff) uint8_t fifo_in_buf[sizeof(ecbuff) + HOST_IN_BUFSIZE];
-ecbuff *fifo_in = (ecbuff *) fifo_in_buf;
+static struct {
+	u8 buf[HOST_IN_BUFSIZE];
+	unsigned rp;    //start of oldest chunk still in use. Written by consumer only
+	unsigned wcur;  //producer: next byte goes here
+	unsigned cstart;    //producer: start of chunk being built
+	unsigned clen;  //producer: length of chunk being built
+	u8 type;    //producer: enum chunk_type of chunk being built
+	bool overflowed;    //producer: data was dropped since last chunk
+	unsigned next;  //consumer: rp value after releasing current chunk
+} rxq;
+
+static _Alignas(ecbuff) uint8_t chunkq_buf[sizeof(ecbuff) + HOST_IN_CHUNKS * sizeof(struct chunk_desc)];
+static ecbuff *chunkq = (ecbuff *) chunkq_buf;
 
 /* FIFO of data to host */
 static _Alignas(ecbuff) uint8_t fifo_out_buf[sizeof(ecbuff) + HOST_OUT_BUFSIZE];
 ecbuff *fifo_out = (ecbuff *) fifo_out_buf;
 
+#define TX_WAIT_MS	500	//give up on a host that doesn't read fifo_out for that long
+static bool tx_stalled;	//gave up waiting; don't wait again until there's room
+
 
 /** Host RX state machine */
 enum e_hrx_state {
 	HRX_RX, // while building a chunk
 	HRX_ESCAPE, // pass next byte without ending chunk
 	HRX_RESYNC, //after a buffer overflow : wait for CR/LF
+	HRX_RESYNC_ESCAPE, //escaped byte while resyncing
+	HRX_FRAME_HDR,  //framed mode: collecting header
+	HRX_FRAME_DATA, //copying payload
 };
 
 static enum e_hrx_state hrx_state = HRX_RX;
 
+/** framed mode, producer side */
+static struct {
+	struct frame_hdr hdr;
+	unsigned hdr_len;   //bytes of hdr received so far
+	unsigned remain;    //payload bytes left to receive
+	bool skip;  //frame too long : drop payload
+} rxf;
+
+/** ABORT_* causes, set by USB ISR, cleared by host_abort_done() */
+static volatile u8 abort_req = 0;
+
+/** reply frames to host */
+static struct {
+	bool framed;    //binary framed mode enabled
+	bool open;  //a reply is being built
+	bool tagged;    //inside host_reply_tagged()
+	u8 tag;
+	int top_tag;    //tag of whole counted reply, -1 if none
+	u8 outer_addr;  //framed mode: restored after tagged sub-reply
+	struct frame_hdr hdr;
+	u8 seg[REPLY_SEGSIZE];
+	unsigned len;
+} reply;
+
+static void reply_async_end(void);
+
 
 
 /***** funcs */
 
 
 void host_comms_init(void) {
-	ecbuff_init(fifo_in, HOST_IN_BUFSIZE, 1);
+	ecbuff_init(pktq, HOST_RX_PACKETS * sizeof(struct rx_packet), sizeof(struct rx_packet));
+	pkt_pos = 0;
+	ecbuff_init(chunkq, HOST_IN_CHUNKS * sizeof(struct chunk_desc), sizeof(struct chunk_desc));
 	ecbuff_init(fifo_out, HOST_OUT_BUFSIZE, 1);
 
+	memset(&rxq, 0, sizeof(rxq));
+	memset(&reply, 0, sizeof(reply));
+	reply.top_tag = -1;
 	hrx_state = HRX_RX;
 	return;
 }
 
-/** filter and save data.
+struct rx_packet *host_rx_pkt_alloc(void) {
+	if (ecbuff_is_full(pktq)) {
+		return NULL;
+	}
+	return (struct rx_packet *) ecbuff_write_alloc(pktq);
+}
+
+void host_rx_pkt_queue(void) {
+	ecbuff_write_enqueue(pktq);
+}
+
+unsigned host_rx_pkt_free(void) {
+	return ecbuff_unused(pktq);
+}
+
+/** drop chunk being built, and wait for next CR/LF */
+static void chunk_drop(void) {
+	sys_incstats(STATS_RXOVF);
+	rxq.wcur = rxq.cstart;
+	rxq.clen = 0;
+	rxq.overflowed = 1;
+	hrx_state = HRX_RESYNC;
+}
+
+/** @return 1 if all published chunks were released : only the chunk being built uses the ring */
+static bool ring_idle(void) {
+	return ecbuff_is_empty(chunkq) && (rxq.rp == rxq.next);
+}
+
+/** @return 1 if the chunk being built is parsed in place, and must not wrap */
+static bool chunk_linear(void) {
+	return (rxq.type == CHUNK_CMD) ||
+		   ((rxq.type == CHUNK_FRAME) && (rxf.hdr.type == FT_CMD));
+}
+
+/** add unescaped bytes to chunk being built
  *
- * Checks for overflow, skips over escaped characters, and
- * appends a CHUNK_VALID / _INVALID guard byte after each chunk.
+ * Commands that would wrap around the end of the ring are moved to its start,
+ * once the consumer has released enough of it.
  *
- * Does not distinguish between data or commands.
- * converts unescaped CR to LF.
+ * @return 0 if the input ring is full but will be freed by the consumer; retry later.
+ * If no other chunk is pending, the chunk being built is simply too long and is dropped.
  */
-void host_comms_rx(uint8_t rxb) {
-	const u8 lf = '\n';
-	const u8 chunkvalid = CHUNK_VALID;  //gross
-	const u8 chunkinvalid = CHUNK_INVALID;  //gross
-
-	if (ecbuff_is_full(fifo_in)) return;
-	if (ecbuff_unused(fifo_in) <= 2) {
-		//XXX could still catch an impending overflow,
-		// but since this is in an interrupt context, not much we can do except drop data safely
-		sys_incstats(STATS_RXOVF);
-
-		ecbuff_write(fifo_in, &lf);
-		ecbuff_write(fifo_in, &chunkinvalid);
-		hrx_state = HRX_RESYNC;
-		return;
+static bool chunk_putn(const u8 *src, unsigned len) {
+	bool idle = ring_idle();
+	unsigned used = idle ? rxq.clen : (rxq.wcur + HOST_IN_BUFSIZE - rxq.rp) % HOST_IN_BUFSIZE;
+	unsigned len0;
+
+	// also keep room for the 0 terminator of commands
+	if ((used + len + 2) > HOST_IN_BUFSIZE) {
+		if (!idle) {
+			return 0;
+		}
+		chunk_drop();
+		return 1;
+	}
+	if (chunk_linear() && rxq.cstart && ((rxq.cstart + rxq.clen + len + 1) > HOST_IN_BUFSIZE)) {
+		// pending chunks are in [rp, cstart) unless they wrap; [0, rp) must hold this one
+		if (!idle && ((rxq.rp > rxq.cstart) || ((rxq.clen + len + 2) > rxq.rp))) {
+			return 0;
+		}
+		memmove(rxq.buf, &rxq.buf[rxq.cstart], rxq.clen);
+		rxq.cstart = 0;
+		rxq.wcur = rxq.clen;
+	}
+	len0 = HOST_IN_BUFSIZE - rxq.wcur;
+	if (len0 > len) {
+		len0 = len;
+	}
+	memcpy(&rxq.buf[rxq.wcur], src, len0);
+	memcpy(rxq.buf, &src[len0], len - len0);
+	rxq.wcur = (rxq.wcur + len) % HOST_IN_BUFSIZE;
+	rxq.clen += len;
+	return 1;
+}
+
+/** publish chunk being built
+ *
+ * @return 0 if the descriptor queue is full; retry later.
+ */
+static bool chunk_end(void) {
+	struct chunk_desc cd;
+
+	if (!rxq.clen) {
+		//stray CR or LF, or second half of CRLF
+		return 1;
+	}
+	if (ecbuff_is_full(chunkq)) {
+		return 0;
+	}
+	cd.offset = rxq.cstart;
+	cd.len = rxq.clen;
+	cd.flags = rxq.overflowed ? CHUNK_F_OVERFLOW : 0;
+	cd.type = rxq.type;
+	if (rxq.type != CHUNK_DATA) {
+		//room for the 0 terminator of commands, FT_CMD frames included
+		rxq.buf[rxq.wcur] = 0;
+		rxq.wcur = (rxq.wcur + 1) % HOST_IN_BUFSIZE;
+	}
+	ecbuff_write(chunkq, &cd);
+
+	rxq.cstart = rxq.wcur;
+	rxq.clen = 0;
+	rxq.overflowed = 0;
+	return 1;
+}
+
+/** publish complete frame */
+static void frame_end(void) {
+	// A skipped FT_EXIT (CHUNK_F_OVERFLOW) gets a RS_EFRAME reply and framed mode goes on;
+	// chunk_frame() only leaves framed mode for the same frames.
+	bool exit = (rxf.hdr.type == FT_EXIT) && !rxq.overflowed;
+
+	(void) chunk_end();
+	//switch back to text mode right away, since text may follow
+	hrx_state = exit ? HRX_RX : HRX_FRAME_HDR;
+}
+
+#define BYTES_ONES	0x01010101UL
+#define BYTES_HIGHS	0x80808080UL
+/** nonzero if any byte of w is 0 */
+#define WORD_HASZERO(w) (((w) - BYTES_ONES) & ~(w) & BYTES_HIGHS)
+/** nonzero if any byte of w equals c */
+#define WORD_HASBYTE(w, c) WORD_HASZERO((w) ^ (BYTES_ONES * (c)))
+
+static bool is_special(u8 rxb) {
+	return (rxb == '\r') || (rxb == '\n') || (rxb == 27);
+}
+
+/** get length of initial run of bytes that are not CR, LF or Escape.
+ *
+ * Checks one word at a time once aligned.
+ */
+static unsigned scan_plain(const u8 *src, unsigned len) {
+	unsigned pos = 0;
+
+	while ((pos < len) && ((uintptr_t) &src[pos] & 3)) {
+		if (is_special(src[pos])) {
+			return pos;
+		}
+		pos++;
+	}
+	for (; (len - pos) >= 4; pos += 4) {
+		uint32_t w;
+		memcpy(&w, __builtin_assume_aligned(&src[pos], 4), 4);
+		if (WORD_HASBYTE(w, '\r') | WORD_HASBYTE(w, '\n') | WORD_HASBYTE(w, 27)) {
+			//pinpoint it below
+			break;
+		}
+	}
+	while ((pos < len) && !is_special(src[pos])) {
+		pos++;
 	}
+	return pos;
+}
+
+/** filter and save a block of data.
+ *
+ * Checks for overflow, strips escapes (except in front of ';' and Escape
+ * in commands), and publishes
+ * a chunk descriptor at every unescaped CR or LF.
+ *
+ * Does not distinguish between data or commands except
+ * to tag the descriptor.
+ *
+ * @return number of bytes consumed; less than len if the input ring is full.
+ */
+static unsigned filter_block(const u8 *src, unsigned len) {
+	unsigned pos = 0;
+	unsigned run;
 
-	switch (hrx_state) {
-	case HRX_RX:
-		switch (rxb) {
-		case '\r':
-		//CR : replace with LF
-		//fallthru
-		case '\n':
-			//terminate chunk normally
-			ecbuff_write(fifo_in, &lf);
-			ecbuff_write(fifo_in, &chunkvalid);
+	while (pos < len) {
+		switch (hrx_state) {
+		case HRX_RX:
+			run = scan_plain(&src[pos], len - pos);
+			if (run) {
+				if (!rxq.clen) {
+					rxq.type = (src[pos] == '+') ? CHUNK_CMD : CHUNK_DATA;
+				}
+				if (!chunk_putn(&src[pos], run)) {
+					return pos;
+				}
+				pos += run;
+				break;
+			}
+			if (src[pos] == 27) {
+				//strip escape char; next byte is kept regardless of value
+				hrx_state = HRX_ESCAPE;
+			} else if (!chunk_end()) {
+				return pos;
+			}
+			pos++;
+			break;
+		case HRX_ESCAPE:
+			//previous byte was Escape: do not check for \r or \n termination
+			hrx_state = HRX_RX;
+			if (!rxq.clen) {
+				rxq.type = CHUNK_DATA;
+			}
+			if ((rxq.type == CHUNK_CMD) && ((src[pos] == ';') || (src[pos] == 27))) {
+				//keep the escape, so an escaped ';' doesn't split a batch (see cmd_batch.h)
+				const u8 esc[2] = {27, src[pos]};
+				if (!chunk_putn(esc, 2)) {
+					hrx_state = HRX_ESCAPE;
+					return pos;
+				}
+			} else if (!chunk_putn(&src[pos], 1)) {
+				hrx_state = HRX_ESCAPE;
+				return pos;
+			}
+			pos++;
+			break;
+		case HRX_RESYNC:
+			//drop all chars except an unescaped CR or LF
+			pos += scan_plain(&src[pos], len - pos);
+			if (pos == len) {
+				break;
+			}
+			hrx_state = (src[pos] == 27) ? HRX_RESYNC_ESCAPE : HRX_RX;
+			pos++;
+			break;
+		case HRX_RESYNC_ESCAPE:
+			hrx_state = HRX_RESYNC;
+			pos++;
+			break;
+		case HRX_FRAME_HDR:
+			if ((rxf.hdr_len == 0) && (src[pos] != FRAME_SYNC)) {
+				//garbage between frames
+				sys_incstats(STATS_RXOVF);
+				pos++;
+				break;
+			}
+			((u8 *) &rxf.hdr)[rxf.hdr_len] = src[pos];
+			if ((rxf.hdr_len + 1) < sizeof(rxf.hdr)) {
+				rxf.hdr_len++;
+				pos++;
+				break;
+			}
+			// header complete. Frames are short enough to always fit once the ring is
+			// drained, and chunkq only gets emptier, so once started, publishing can't fail.
+			if (ecbuff_is_full(chunkq)) {
+				return pos;
+			}
+			rxq.type = CHUNK_FRAME;
+			if (!chunk_putn((const u8 *) &rxf.hdr, sizeof(rxf.hdr))) {
+				return pos;
+			}
+			pos++;
+			rxf.hdr_len = 0;
+			rxf.remain = rxf.hdr.len[0] | (rxf.hdr.len[1] << 8);
+			rxf.skip = (rxf.remain > FRAME_MAXLEN);
+			if (rxf.skip) {
+				sys_incstats(STATS_RXOVF);
+				rxq.overflowed = 1;
+			}
+			hrx_state = HRX_FRAME_DATA;
+			if (!rxf.remain) {
+				frame_end();
+			}
+			break;
+		case HRX_FRAME_DATA:
+			run = len - pos;
+			if (run > rxf.remain) {
+				run = rxf.remain;
+			}
+			if (!rxf.skip && !chunk_putn(&src[pos], run)) {
+				return pos;
+			}
+			pos += run;
+			rxf.remain -= run;
+			if (!rxf.remain) {
+				frame_end();
+			}
 			break;
-		case 27:
-			//if it was an escape, it needs to be passed on
-			hrx_state = HRX_ESCAPE;
-		//fallthru
 		default:
-			ecbuff_write(fifo_in, &rxb);
+			assert_failed();
 			break;
 		}
-		break;
-	case HRX_ESCAPE:
-		//previous byte was Escape: do not check for \r or \n termination
-		hrx_state = HRX_RX;
-		ecbuff_write(fifo_in, &rxb);
-		break;
-	case HRX_RESYNC:
-		//drop all chars except a CR or LF
-		//TODO : skip unescaped CR/LF in case we were receiving tons of data
-		if ((rxb == '\r') || (rxb == '\n')) {
-			hrx_state = HRX_RX;
+	}
+	return pos;
+}
+
+void host_comms_poll(void) {
+	struct rx_packet *pkt;
+
+	// any output since the last request was done
+	reply_async_end();
+
+	while ((pkt = (struct rx_packet *) ecbuff_read_dequeue(pktq)) != NULL) {
+		pkt_pos += filter_block(&pkt->data[pkt_pos], pkt->len - pkt_pos);
+		if (pkt_pos < pkt->len) {
+			//input ring full; resume once cmd_poll() has released some chunks
+			return;
 		}
-		break;
-	default:
-		assert_failed();
-		break;
+		pkt_pos = 0;
+		ecbuff_read_free(pktq);
 	}
 }
 
 
+/** wait for room in fifo_out
+ *
+ * @return 0 if the host stopped reading : abort request (e.g. port closed),
+ * or no room for TX_WAIT_MS
+ */
+static bool fifo_wait_room(void) {
+	u32 t0 = get_ms();
+
+	while (ecbuff_is_full(fifo_out)) {
+		if (tx_stalled || host_abort_pending() || TS_ELAPSED(get_ms(), t0, TX_WAIT_MS)) {
+			tx_stalled = 1;
+			sys_incstats(STATS_TXOVF);
+			return 0;
+		}
+	}
+	tx_stalled = 0;
+	return 1;
+}
+
+/** write to fifo_out, waiting for room; the rest is dropped if the host stops reading */
+static void fifo_put_wait(const u8 *data, unsigned len) {
+	unsigned idx;
+	for (idx = 0; idx < len; idx++) {
+		if (!fifo_wait_room()) {
+			return;
+		}
+		assert_basic(ecbuff_write(fifo_out, &data[idx]));
+	}
+}
+
+/** send reply frame (or text segment) with current segment */
+static void reply_flush(enum reply_status status) {
+	if (!reply.framed) {
+		char thdr[REPLY_HDRMAX];
+		int hlen;
+		if (reply.tagged && (reply.top_tag >= 0)) {
+			hlen = snprintf(thdr, sizeof(thdr), "#%u.%u:%u,%u\n", (unsigned) reply.top_tag,
+							(unsigned) reply.tag, (unsigned) status, reply.len);
+		} else if (reply.tagged || (reply.top_tag >= 0)) {
+			u8 tag = reply.tagged ? reply.tag : reply.top_tag;
+			hlen = snprintf(thdr, sizeof(thdr), "#%u:%u,%u\n", (unsigned) tag, (unsigned) status, reply.len);
+		} else {
+			hlen = snprintf(thdr, sizeof(thdr), "#%u,%u\n", (unsigned) status, reply.len);
+		}
+		fifo_put_wait((const u8 *) thdr, hlen);
+		fifo_put_wait(reply.seg, reply.len);
+		reply.len = 0;
+		return;
+	}
+	reply.hdr.flags = status;
+	reply.hdr.len[0] = reply.len & 0xFF;
+	reply.hdr.len[1] = reply.len >> 8;
+	fifo_put_wait((const u8 *) &reply.hdr, sizeof(reply.hdr));
+	fifo_put_wait(reply.seg, reply.len);
+	reply.len = 0;
+}
+
+static void reply_start(u8 type, u8 seq, u8 addr) {
+	reply.hdr.sync = FRAME_SYNC;
+	reply.hdr.type = type | FT_REPLY;
+	reply.hdr.seq = seq;
+	reply.hdr.addr = addr;
+	reply.len = 0;
+	reply.open = 1;
+}
+
+/** add byte to current reply. */
+static void reply_put(u8 txb) {
+	if (!reply.open) {
+		reply_start(FT_ASYNC, 0, FRAME_ADDR_DEFAULT);
+	}
+	reply.seg[reply.len++] = txb;
+	if (reply.len == REPLY_SEGSIZE) {
+		reply_flush(RS_MORE);
+	}
+}
+
+/** flush pending async output */
+static void reply_async_end(void) {
+	if (reply.framed && reply.open && (reply.hdr.type == (FT_ASYNC | FT_REPLY))) {
+		reply_flush(RS_OK);
+		reply.open = 0;
+	}
+}
+
+void host_reply_begin(uint8_t type, uint8_t seq, uint8_t addr) {
+	if (!reply.framed) {
+		return;
+	}
+	reply_async_end();
+	reply_start(type, seq, addr);
+}
+
+void host_reply_counted(void) {
+	host_reply_counted_tag(-1);
+}
+
+void host_reply_counted_tag(int tag) {
+	if (reply.framed || reply.open) {
+		return;
+	}
+	reply.len = 0;
+	reply.top_tag = tag;
+	reply.open = 1;
+}
+
+void host_reply_cancel(void) {
+	if (reply.framed || !reply.open || reply.tagged) {
+		return;
+	}
+	reply.len = 0;
+	reply.top_tag = -1;
+	reply.open = 0;
+}
+
+void host_reply_tagged(uint8_t tag) {
+	if (!reply.open) {
+		return;
+	}
+	if (reply.len) {
+		reply_flush(RS_MORE);
+	}
+	reply.tagged = 1;
+	reply.tag = tag;
+	reply.outer_addr = reply.hdr.addr;
+	reply.hdr.addr = tag;
+}
+
+void host_reply_end(enum reply_status status) {
+	if (!reply.open) {
+		return;
+	}
+	reply_flush(status);
+	if (reply.tagged) {
+		//back to enclosing reply
+		reply.tagged = 0;
+		reply.hdr.addr = reply.outer_addr;
+		return;
+	}
+	reply.open = 0;
+}
+
+void host_set_framed(bool framed) {
+	if (framed == reply.framed) {
+		return;
+	}
+	reply_async_end();
+	reply.framed = framed;
+	if (framed) {
+		rxf.hdr_len = 0;
+		hrx_state = HRX_FRAME_HDR;
+	}
+	//when leaving, input was already switched back to text mode after the FT_EXIT frame
+}
+
+bool host_framed(void) {
+	return reply.framed;
+}
+
+
 void host_tx(uint8_t txb) {
+	if (reply.framed || reply.open) {
+		reply_put(txb);
+		return;
+	}
 	if (!ecbuff_write(fifo_out, &txb)) {
 		sys_incstats(STATS_TXOVF);
 	}
@@ -133,17 +594,43 @@ void host_tx(uint8_t txb) {
 
 
 void host_tx_blocking(uint8_t txb) {
-	while (ecbuff_is_full(fifo_out)) {}
-	assert_basic(ecbuff_write(fifo_out, &txb));
+	if (reply.framed || reply.open) {
+		reply_put(txb);
+		return;
+	}
+	if (fifo_wait_room()) {
+		assert_basic(ecbuff_write(fifo_out, &txb));
+	}
 	return;
 }
 
+bool host_tx_try(uint8_t txb) {
+	if (reply.framed || reply.open) {
+		// the byte that fills the segment flushes it : header + whole segment
+		if ((reply.len == (REPLY_SEGSIZE - 1)) &&
+			(ecbuff_unused(fifo_out) < (REPLY_HDRMAX + REPLY_SEGSIZE))) {
+			return 0;
+		}
+		reply_put(txb);
+		return 1;
+	}
+	if (ecbuff_is_full(fifo_out)) {
+		return 0;
+	}
+	assert_basic(ecbuff_write(fifo_out, &txb));
+	return 1;
+}
+
 void host_tx_m(uint8_t *data, unsigned len) {
 	assert_basic(len <= HOST_IN_BUFSIZE);
 
 	//fugly, loop write
 	unsigned idx;
 	for (idx = 0; idx < len; idx++) {
+		if (reply.framed || reply.open) {
+			reply_put(data[idx]);
+			continue;
+		}
 		if (!ecbuff_write(fifo_out, &data[idx])) {
 			sys_incstats(STATS_TXOVF);
 			return;
@@ -152,7 +639,85 @@ void host_tx_m(uint8_t *data, unsigned len) {
 	return;
 }
 
+void host_abort_request(uint8_t cause) {
+	abort_req |= cause;
+}
+
+uint8_t host_abort_pending(void) {
+	return abort_req;
+}
+
+void host_abort_done(void) {
+	// ISR is the producer for pktq, so only consume from this side
+	while (ecbuff_read_dequeue(pktq) != NULL) {
+		ecbuff_read_free(pktq);
+	}
+	pkt_pos = 0;
+	ecbuff_init(chunkq, HOST_IN_CHUNKS * sizeof(struct chunk_desc), sizeof(struct chunk_desc));
+	memset(&rxq, 0, sizeof(rxq));
+	rxf.hdr_len = 0;
+	hrx_state = reply.framed ? HRX_FRAME_HDR : HRX_RX;
+	abort_req = 0;
+}
+
 bool host_rx_datapresent(void) {
-	return !ecbuff_is_empty(fifo_in);
+	if (reply.framed || (reply.open && (reply.top_tag >= 0))) {
+		//pipelined requests : queued input must not interrupt the current one
+		return 0;
+	}
+	//either unfiltered packets, a complete chunk, or the start of one
+	return !ecbuff_is_empty(pktq) || !ecbuff_is_empty(chunkq) || (rxq.wcur != rxq.cstart);
 }
 
+/**** chunk extraction, consumer side.
+ *
+ * Chunks are used in-place; everything from rxq.rp to the end
+ * of the current chunk belongs to us until host_rx_release().
+ */
+
+/** fill chunk view from descriptor */
+static void chunk_view(struct rx_chunk *chunk, const struct chunk_desc *cd) {
+	unsigned len0 = HOST_IN_BUFSIZE - cd->offset;
+
+	if (len0 > cd->len) {
+		len0 = cd->len;
+	}
+	chunk->type = cd->type;
+	chunk->flags = cd->flags;
+	chunk->data[0] = &rxq.buf[cd->offset];
+	chunk->len[0] = len0;
+	chunk->data[1] = rxq.buf;
+	chunk->len[1] = cd->len - len0;
+
+	if (cd->type == CHUNK_FRAME) {
+		//split header off the payload
+		u8 *hdr = (u8 *) &chunk->hdr;
+		unsigned hlen = sizeof(chunk->hdr);
+		if (len0 < hlen) {
+			memcpy(hdr, chunk->data[0], len0);
+			memcpy(&hdr[len0], chunk->data[1], hlen - len0);
+			chunk->data[0] = &chunk->data[1][hlen - len0];
+			chunk->len[0] = chunk->len[1] - (hlen - len0);
+			chunk->len[1] = 0;
+		} else {
+			memcpy(hdr, chunk->data[0], hlen);
+			chunk->data[0] += hlen;
+			chunk->len[0] -= hlen;
+		}
+	}
+}
+
+bool host_rx_getchunk(struct rx_chunk *chunk) {
+	struct chunk_desc cd;
+
+	if (!ecbuff_read(chunkq, &cd)) {
+		return 0;
+	}
+	rxq.next = (cd.offset + cd.len + (cd.type != CHUNK_DATA)) % HOST_IN_BUFSIZE;
+	chunk_view(chunk, &cd);
+	return 1;
+}
+
+void host_rx_release(void) {
+	rxq.rp = rxq.next;
+}
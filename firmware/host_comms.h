@@ -19,15 +19,151 @@
  * ignoring the data up to then.
  */
 
-#define HOST_IN_BUFSIZE	 256
+#define HOST_IN_BUFSIZE	 448
 #define HOST_OUT_BUFSIZE 512
 
-/* at the end of each \n-terminated chunk in the
- * FIFO, we place a guard byte. This might be set
- * to INVALID if we detect read errors
+/* max number of complete chunks waiting to be parsed (+1) */
+#define HOST_IN_CHUNKS 16
+
+/* raw USB packets waiting to be filtered (+1) */
+#define HOST_RX_PACKETS 4
+#define HOST_RX_PKTSIZE 64  //bulk EP max packet size
+
+/** raw packet from host, unfiltered */
+struct rx_packet {
+	uint8_t data[HOST_RX_PKTSIZE];
+	uint32_t len;   //also keeps elements word-aligned in the ring
+};
+
+/* Input from host is split into chunks, terminated by unescaped CR or LF.
+ * Each completed chunk is published as a descriptor; the unescaped data
+ * is stored back to back in a separate ring. Command chunks are followed
+ * by an extra 0 byte, and keep the Escape in front of ';' and Escape
+ * (see cmd_batch.h).
+ */
+enum chunk_type {
+	CHUNK_DATA, //to be sent on the bus
+	CHUNK_CMD,  //starts with an unescaped '+'
+	CHUNK_FRAME,    //binary framed mode, see below
+};
+
+/* chunk flags */
+#define CHUNK_F_OVERFLOW	0x01    //input was lost before this chunk
+
+struct chunk_desc {
+	uint16_t offset;    //in input ring
+	uint16_t len;   //excluding 0 terminator
+	uint8_t flags;
+	uint8_t type;   //enum chunk_type
+};
+
+
+/* Binary framed mode
+ *
+ * Entered with "++bin" from the normal text mode. The device answers with an empty
+ * FT_CMD reply (seq 0); the host must wait for it before sending frames.
+ *
+ * Every frame starts with a struct frame_hdr, followed by 'len' bytes of payload
+ * that are not escaped or filtered in any way.
+ * The device sends one or more reply frames for every request, with the same
+ * type (| FT_REPLY), seq and addr; the status of the last reply frame is
+ * never RS_MORE. Requests are processed in order, so the host may send
+ * more requests without waiting for replies.
+ *
+ * Output not related to a request (debug messages, listen-only data) is sent
+ * in FT_ASYNC frames.
+ */
+#define FRAME_SYNC	0xA5
+#define FRAME_MAXLEN	256 //payload; longer frames are skipped and get a RS_EFRAME reply
+#define FRAME_ADDR_DEFAULT	0xFF   //use current ++addr
+#define REPLY_SEGSIZE	64  //max payload of reply frames
+#define REPLY_HDRMAX	16  //max size of a segment header, text or framed
+
+struct frame_hdr {
+	uint8_t sync;   //FRAME_SYNC
+	uint8_t type;   //enum frame_type
+	uint8_t seq;    //echoed in reply
+	uint8_t addr;   //GPIB primary address, or FRAME_ADDR_DEFAULT
+	uint8_t flags;  //in replies: enum reply_status
+	uint8_t len[2]; //payload length, little-endian
+};
+
+enum frame_type {
+	FT_CMD = 1, //payload is a command line such as "++eoi 1"; reply has its output
+	FT_WRITE = 2,   //payload is written to 'addr'. flags : FF_*
+	FT_READ = 3,    //read from 'addr' until EOI (FF_EOS: until char in payload[0])
+	FT_EXIT = 4,    //return to text mode after the reply
+	FT_ASYNC = 5,   //only sent by device
+	FT_REPLY = 0x80,
+};
+
+/* FT_WRITE, FT_READ flags */
+#define FF_EOI	0x01    //assert EOI with last byte
+#define FF_READ	0x02    //after write, read until EOI
+#define FF_CONT	0x04    //don't address target again (continuation of previous frame)
+#define FF_EOS	0x08    //FT_READ only: read until char given in payload[0]
+
+enum reply_status {
+	RS_OK = 0,
+	RS_MORE,    //more reply frames follow
+	RS_TIMEOUT,
+	RS_EINVAL,  //bad request or command
+	RS_EMODE,   //not possible in current mode
+	RS_EFRAME,  //frame too long, or data lost
+	RS_ABORT,   //interrupted by host
+	RS_EOI,     //read ended by EOI
+	RS_EOS,     //read ended by EOS char
+};
+
+/** enable or disable framed mode.
+ *
+ * Must be called between chunks, i.e. from a command handler.
+ */
+void host_set_framed(bool framed);
+
+/** @return 1 in framed mode */
+bool host_framed(void);
+
+/** start a reply to a request
+ *
+ * In framed mode, host_tx*() output is then packed into reply frames until host_reply_end().
+ * No effect in text mode.
+ */
+void host_reply_begin(uint8_t type, uint8_t seq, uint8_t addr);
+
+/** start a counted reply in text mode
+ *
+ * host_tx*() output is then sent in segments of the form
+ * "#<status>,<len>\n" followed by <len> bytes, until host_reply_end().
+ * The status of the last segment is never RS_MORE.
+ * In framed mode, or if a counted reply is already open, output simply goes
+ * to the current reply.
+ */
+void host_reply_counted(void);
+
+/** start a counted reply in text mode, with segment headers "#<tag>:<status>,<len>\n"
+ *
+ * Lets the host match replies to pipelined requests. Tagged sub-replies inside it
+ * have headers "#<tag>.<subtag>:<status>,<len>\n".
+ * @param tag 0-255, or -1 for a plain counted reply
+ */
+void host_reply_counted_tag(int tag);
+
+/** close a counted reply that got no output at all, without sending anything */
+void host_reply_cancel(void);
+
+/** start a tagged sub-reply inside the current reply
+ *
+ * Used for multiple results in one reply. Until the matching host_reply_end(),
+ * text segment headers are "#<tag>:<status>,<len>\n"; in framed mode, reply frames
+ * have addr = tag. After that, the enclosing reply continues.
+ */
+void host_reply_tagged(uint8_t tag);
+
+/** send last reply segment with status.
+ * No effect if there is no reply open, i.e. if it was already ended
  */
-#define CHUNK_INVALID 0
-#define CHUNK_VALID	  1
+void host_reply_end(enum reply_status status);
 
 
 /** initialize host comms workers
@@ -40,33 +176,48 @@ void host_comms_init(void);
 /****************
 * data flow :
 * from host :
-* - USB interrupt calls host_comms_rx() for each byte
-* - host_comms_rx() does initial filtering and fills
-*   fifo_in.
-* - cmd_poll() empties fifo_in
-*
-* XXX no mechanism to set EP to NAK if fifo_in full
+* - USB interrupt reads each packet directly into a slot of the packet ring
+*   (host_rx_pkt_alloc() / host_rx_pkt_queue()), and NAKs the OUT endpoint
+*   when taking the last free slot.
+* - in the main loop, host_comms_poll() filters one packet at a time: strips escapes,
+*   fills the input ring and publishes chunk descriptors.
+*   If the input ring is full, the packet stays queued until cmd_poll() frees some space.
+* - cmd_poll() takes one chunk at a time (see host_rx_getchunk())
+* - in framed mode, each frame (header + payload) is one chunk.
 *
 *
 * to host:
 * - code (mostly printf) calls host_tx() or host_tx_m()
-* - host_tx() fills fifo_out
+* - host_tx() fills fifo_out; in framed mode, through the current reply frame
 * - USB interrupt empties fifo_out
 */
 
 
-/** callback for data received from host
+/** get a free slot for the next packet from host
+ *
+ * called from interrupt context.
+ * @return NULL if the packet ring is full
+ */
+struct rx_packet *host_rx_pkt_alloc(void);
+
+/** queue the packet slot obtained with host_rx_pkt_alloc()
  *
- * called from interrupt context
+ * called from interrupt context.
  */
-void host_comms_rx(uint8_t rxb);
+void host_rx_pkt_queue(void);
+
+/** number of free packet slots */
+unsigned host_rx_pkt_free(void);
+
+/** filter queued packets from host into chunks.
+ *
+ * called from main loop.
+ */
+void host_comms_poll(void);
 
 /** FIFO to host */
 extern ecbuff *fifo_out;
 
-/** FIFO from host */
-extern ecbuff *fifo_in;
-
 /** TX to host: queue one byte
  *
  * manages USART interrupts etc.
@@ -74,11 +225,20 @@ extern ecbuff *fifo_in;
  */
 void host_tx(uint8_t txb);
 
-/** TX to host: queue one byte, infinitely blocking
+/** TX to host: queue one byte, waiting for room
  *
+ * Gives up (byte dropped, counted as TX overflow) on an abort request, e.g.
+ * when the host closes the port, or if the host doesn't read for a while.
  */
 void host_tx_blocking(uint8_t txb);
 
+/** TX to host: queue one byte only if that doesn't need to wait
+ *
+ * For loops that must keep watching something else (GPIB lines...) while the host is slow.
+ * @return 0 if nothing was queued
+ */
+bool host_tx_try(uint8_t txb);
+
 /** queue multiple bytes to send to host
 *
 * @param len max HOST_IN_BUFSIZE bytes. extra data is dropped
@@ -88,7 +248,52 @@ void host_tx_m(uint8_t *data, unsigned len);
 
 
 /** check if pending data from host.
- * use to abort read loops etc */
+ * use to abort read loops etc.
+ * Always 0 in framed mode and in tagged replies, since hosts are expected to
+ * send requests ahead.
+ */
 bool host_rx_datapresent(void);
 
+/* causes of host_abort_request() */
+#define ABORT_BREAK	0x01    //CDC SEND_BREAK : stop everything, including ++scan
+#define ABORT_CLOSED	0x02    //DTR drop : host closed the port, only its requests are dropped
+
+/** out-of-band abort from host. Called in ISR context
+ * @param cause ABORT_*
+ */
+void host_abort_request(uint8_t cause);
+
+/** check if an abort is pending. GPIB wait loops give up when set
+ * @return ABORT_* causes since the last host_abort_done(), 0 if none
+ */
+uint8_t host_abort_pending(void);
+
+/** drop all pending input and clear the abort request.
+ * Main loop only, not while a chunk is being used.
+ */
+void host_abort_done(void);
+
+/** view of a complete, unescaped chunk inside the input ring */
+struct rx_chunk {
+	uint8_t *data[2];   //second segment is used if the chunk wraps around the end of the ring
+	unsigned len[2];
+	enum chunk_type type;   //if CHUNK_CMD: data[0] is contiguous and 0-terminated, len[1] == 0.
+	uint8_t flags;
+	struct frame_hdr hdr;   //if CHUNK_FRAME. data[] is then the payload; for FT_CMD, contiguous and 0-terminated like CHUNK_CMD
+};
+
+/** get next chunk from host
+ *
+ * No copying or re-scanning is done; the chunk stays in the input ring.
+ * The chunk contents may be modified by the caller.
+ *
+ * @return 1 if a complete chunk is available. It then stays valid
+ * (and keeps using ring space) until host_rx_release() is called,
+ * which must be done before the next call.
+ */
+bool host_rx_getchunk(struct rx_chunk *chunk);
+
+/** release chunk obtained with host_rx_getchunk() */
+void host_rx_release(void);
+
 #endif // _HOST_COMMS_H
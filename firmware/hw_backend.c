@@ -9,6 +9,8 @@
 #include <printf/printf.h>
 
 #include <libopencm3/stm32/dbgmcu.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/flash.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/iwdg.h>
@@ -231,6 +233,8 @@ static void setOperatingMode(enum operatingModes mode) {
 		assert_basic(0);
 		break;
 	}
+	// we drive ATN and IFC ourselves in controller mode
+	bus_irq_enable(mode == OP_DEVI);
 }
 
 
@@ -244,13 +248,11 @@ static void setOperatingMode(enum operatingModes mode) {
 	#define SN7516X_SC
 #endif
 
+static enum gpib_states gpibstate = CINI;
+
 /***** Control the GPIB bus - set various GPIB states *****/
-void setControls(enum gpib_states gs) {
-	static enum gpib_states gpibstate = CINI;
-	if (gpibstate == gs) {
-		return;
-	}
-	DEBUG_PRINTF("gpibstate %s => %s\n", gpib_states_s[gpibstate], gpib_states_s[gs]);
+/** also called from bus_isr() : no debug output here */
+static void apply_controls(enum gpib_states gs) {
 	switch (gs) {
 	case CINI:      // Initialisation
 		setOperatingMode(OP_CTRL);
@@ -349,6 +351,16 @@ void setControls(enum gpib_states gs) {
 	gpibstate = gs;
 }
 
+void setControls(enum gpib_states gs) {
+	if (gpibstate == gs) {
+		return;
+	}
+	DEBUG_PRINTF("gpibstate %s => %s\n", gpib_states_s[gpibstate], gpib_states_s[gs]);
+	bool i = disable_irq();
+	apply_controls(gs);
+	restore_irq(i);
+}
+
 
 /***** Set the transmission mode *****/
 static void output_setmodes(enum transmitModes mode) {
@@ -383,6 +395,61 @@ void unassert_signal(uint32_t gpioport, uint16_t gpios) {
 	gpio_set(gpioport, gpios);
 }
 
+/****** device mode : ATN / IFC interrupts */
+
+#if ((ATN | IFC) & (GPIO0 | GPIO1))
+#error ATN and IFC EXTI lines assumed to be handled by exti2_3_isr / exti4_15_isr
+#endif
+
+static volatile bool ifc_seen = 0;
+
+void bus_irq_enable(bool enable) {
+	if (!enable) {
+		exti_disable_request(ATN | IFC);
+		return;
+	}
+	exti_select_source(ATN, HCTRL2_CP);
+	exti_select_source(IFC, HCTRL2_CP);
+	exti_set_trigger(ATN | IFC, EXTI_TRIGGER_FALLING);
+	exti_reset_request(ATN | IFC);
+	exti_enable_request(ATN | IFC);
+}
+
+bool bus_ifc_seen(bool clear) {
+	bool rv = ifc_seen;
+	if (clear) {
+		ifc_seen = 0;
+	}
+	return rv;
+}
+
+/** ATN or IFC asserted */
+static void bus_isr(void) {
+	u32 flags = exti_get_flag_status(ATN | IFC);
+	exti_reset_request(flags);
+
+	if (flags & IFC) {
+		apply_controls(DIDS);
+		ifc_seen = 1;
+		return;
+	}
+	if (flags & ATN) {
+		// stop talking, and hold off the controller (NRFD + NDAC) until the
+		// command acceptor runs. This meets t2, unlike polling from the main loop.
+		apply_controls(DLAS);
+		dio_float();
+		gpio_clear(HCTRL1_CP, NRFD | NDAC);
+	}
+}
+
+void exti2_3_isr(void) {
+	bus_isr();
+}
+
+void exti4_15_isr(void) {
+	bus_isr();
+}
+
 /********* TIMERS
  *
  *
@@ -443,6 +510,24 @@ uint32_t get_ms(void) {
 	return freerun_ms;
 }
 
+uint32_t get_us32(void) {
+	u32 ms, cvr;
+	u32 reload = STK_RVR;
+	bool pend;
+
+	do {
+		ms = freerun_ms;
+		cvr = STK_CVR;
+		pend = SCB_ICSR & SCB_ICSR_PENDSTSET;
+	} while (ms != freerun_ms);
+	if (pend && (cvr > (reload / 2))) {
+		// systick wrapped but its interrupt hasn't run yet (masked)
+		ms += 1;
+	}
+	// systick counts down from reload
+	return (ms * 1000) + (((reload - cvr) * 1000) / (reload + 1));
+}
+
 /********* WDT
 *
 * we'll use the IWDG module
@@ -467,6 +552,36 @@ void restart_wdt(void) {
 	iwdg_reset();
 }
 
+/********** flash
+*/
+
+/** check and clear flash error flags
+ * @return E_OK if last operation succeeded
+ */
+static enum errcodes flash_status(void) {
+	u32 sr = FLASH_SR;
+	FLASH_SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+	if (sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) {
+		return E_FIFO;
+	}
+	return E_OK;
+}
+
+enum errcodes flash_prog16(uint32_t addr, uint16_t data) {
+	flash_unlock();
+	flash_program_half_word(addr, data);
+	flash_lock();
+	return flash_status();
+}
+
+enum errcodes flash_erase(uint32_t page_addr) {
+	restart_wdt();
+	flash_unlock();
+	flash_erase_page(page_addr);
+	flash_lock();
+	return flash_status();
+}
+
 /********** misc
 */
 
@@ -518,12 +633,16 @@ void sys_incstats(enum stats_type st) {
 	restore_irq(i);
 }
 
-void sys_printstats(void) {
-	unsigned rx_ovf, tx_ovf;
+void sys_getstats(unsigned *rx_ovf, unsigned *tx_ovf) {
 	bool i = disable_irq();
-	rx_ovf = stats.rx_ovf;
-	tx_ovf = stats.tx_ovf;
+	*rx_ovf = stats.rx_ovf;
+	*tx_ovf = stats.tx_ovf;
 	restore_irq(i);
+}
+
+void sys_printstats(void) {
+	unsigned rx_ovf, tx_ovf;
+	sys_getstats(&rx_ovf, &tx_ovf);
 
 	printf("last reset: %c\nlast error: %i\ntxovf: %u, rxovf: %u\n", \
 		   (char) sys_state.reset_reason, sys_state.assert_reason, tx_ovf, rx_ovf);
@@ -582,6 +701,8 @@ void hw_setup(void) {
 
 	rcc_periph_clock_enable(RCC_GPIOA);
 	rcc_periph_clock_enable(RCC_GPIOB);
+	/* EXTI source selection */
+	rcc_periph_clock_enable(RCC_SYSCFG_COMP);
 	/* need this to be able to halt the wdt while debugging */
 	rcc_periph_clock_enable(RCC_DBGMCU);
 
@@ -592,4 +713,7 @@ void hw_setup(void) {
 	output_init();
 	enable_5v(1);
 	led_setup();
+
+	nvic_enable_irq(NVIC_EXTI2_3_IRQ);
+	nvic_enable_irq(NVIC_EXTI4_15_IRQ);
 }
@@ -10,6 +10,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "firmware.h"
+
 /** Initialize hardware back-end
  *
  * includes peripheral clocks, timers, and IO.
@@ -29,6 +31,12 @@ uint32_t get_ms(void);
 /** Get current timestamp in us */
 uint16_t get_us(void);
 
+/** Get current timestamp in us, 32-bit (wraps after ~71 minutes)
+ *
+ * based on systick, so it keeps counting with interrupts briefly masked.
+ */
+uint32_t get_us32(void);
+
 void reset_cpu(void);
 
 /** restart in DFU mode */
@@ -47,6 +55,22 @@ static __inline__ uint32_t get_pc(void)  {
 }
 
 
+/**************** flash
+* for the config and macro stores. Code runs from flash, so the CPU
+* simply stalls during the operation.
+*/
+
+/** program one half-word. Target must be erased, or data must be 0
+ * @return E_OK, or E_FIFO on error
+ */
+enum errcodes flash_prog16(uint32_t addr, uint16_t data);
+
+/** erase one flash page
+ * @return E_OK, or E_FIFO on error
+ */
+enum errcodes flash_erase(uint32_t page_addr);
+
+
 enum stats_type {
 	STATS_RXOVF,
 	STATS_TXOVF
@@ -61,6 +85,9 @@ void sys_incstats(enum stats_type);
 /** print some system info & stats */
 void sys_printstats(void);
 
+/** get stats counters. ISR-safe */
+void sys_getstats(unsigned *rx_ovf, unsigned *tx_ovf);
+
 /**************** IO
 */
 enum LED_PATTERN {
@@ -105,10 +132,15 @@ void assert_signal(uint32_t gpioport, uint16_t gpios);
  */
 void unassert_signal(uint32_t gpioport, uint16_t gpios);
 
-/**************** EEPROM
-* TODO ? these could be replaced by "EEPROM emulation", see ST AN2594
-*/
-#define write_eeprom(addr, data)
-#define read_eeprom(addr) 0
+/** device mode : interrupts on ATN and IFC falling edges.
+ *
+ * On ATN, the ISR stops any talker output and asserts NRFD + NDAC right away,
+ * so the controller waits until the command acceptor (device_atn) runs.
+ * On IFC, the bus is released. Enabled by setControls(DINI), disabled by CINI.
+ */
+void bus_irq_enable(bool enable);
+
+/** @return 1 if IFC was asserted (device mode) since last cleared */
+bool bus_ifc_seen(bool clear);
 
 #endif //_HW_BACKEND_H
@@ -0,0 +1,310 @@
+/* Command macro store
+ *
+ * (c) fenugrec 2018-2021
+ * GPLv3
+ *
+ * Page layout : 16-bit page status, 16-bit pad, then records.
+ * Record : status (half-word), text length (half-word), then text
+ * "<name>\n<line>\n<line>\n...", padded to a half-word boundary.
+ * The status is programmed when recording starts, the length when it ends;
+ * a record without length (reset while recording) ends the log, and the rest
+ * of the page is unusable until the next compaction.
+ *
+ * Compaction is a page transfer (see flash_pair.h) : live records are copied to
+ * the other page, which then becomes active.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "macro_store.h"
+#include "firmware.h"
+#include "flash_pair.h"
+#include "hw_backend.h"
+
+#include "stypes.h"
+
+
+#define MREC_LIVE	0xA55A
+#define MREC_DEAD	0x0000
+#define MREC_END	0xFFFF  //erased : end of log
+#define MREC_HDR	4
+
+#define PAGE_START	FPAIR_START(&ms.fp)
+#define PAGE_END	FPAIR_END(&ms.fp)
+
+static struct {
+	struct flash_pair fp;
+	uint32_t wpos;  //end of records : next record, or record being recorded
+	bool full;  //rest of page not writable (unfinished record) until compacted
+	uint32_t rec;   //record being recorded, 0 if none
+	uint32_t tpos;  //next half-word of text
+	unsigned tlen;  //text bytes so far
+	int odd;    //byte waiting for its half-word, -1 if none
+} ms = {
+	.fp = {MACRO_BASE, MACRO_PAGESIZE, 0},
+};
+
+
+static uint32_t rec_next(uint32_t rec) {
+	u16 len = FLASH16(rec + 2);
+	return rec + MREC_HDR + ((len + 1U) & ~1U);
+}
+
+static const char *rec_text(uint32_t rec) {
+	return (const char *) (rec + MREC_HDR);
+}
+
+/** @return length of record name */
+static unsigned rec_namelen(uint32_t rec) {
+	const char *nl = memchr(rec_text(rec), '\n', FLASH16(rec + 2));
+	if (!nl) {
+		return 0;
+	}
+	return nl - rec_text(rec);
+}
+
+static bool rec_match(uint32_t rec, const char *name, unsigned namelen) {
+	return (FLASH16(rec) == MREC_LIVE) && (rec_namelen(rec) == namelen) &&
+		   !memcmp(rec_text(rec), name, namelen);
+}
+
+/** find end of log in the active page */
+static void scan_page(void) {
+	u32 rec;
+
+	ms.rec = 0;
+	ms.full = 0;
+	for (rec = PAGE_START; rec < PAGE_END; rec = rec_next(rec)) {
+		u16 status = FLASH16(rec);
+		if (status == MREC_END) {
+			break;
+		}
+		if (((status != MREC_LIVE) && (status != MREC_DEAD)) ||
+			(FLASH16(rec + 2) == 0xFFFF) || (rec_next(rec) > PAGE_END)) {
+			// unfinished or garbage : no more room
+			ms.full = 1;
+			break;
+		}
+	}
+	ms.wpos = rec;
+}
+
+void macro_store_init(void) {
+	fpair_init(&ms.fp);
+	scan_page();
+}
+
+bool macro_recording(void) {
+	return ms.rec != 0;
+}
+
+static int copy16(uint32_t dst, uint32_t src, unsigned len) {
+	unsigned i;
+
+	for (i = 0; i < len; i += 2) {
+		if (flash_prog16(dst + i, FLASH16(src + i))) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** @return bytes used by live records, and by the one being recorded */
+static unsigned live_size(void) {
+	unsigned used = 0;
+	u32 rec;
+
+	for (rec = PAGE_START; rec < ms.wpos; rec = rec_next(rec)) {
+		if (FLASH16(rec) == MREC_LIVE) {
+			used += rec_next(rec) - rec;
+		}
+	}
+	if (ms.rec) {
+		used += ms.tpos - ms.rec;
+	}
+	return used;
+}
+
+/** copy live records, and the one being recorded, to the other page and make it active
+ *
+ * @return 0 if ok. Nothing changes if that wouldn't free anything, or if the copy fails.
+ */
+static int compact(void) {
+	unsigned oldpage = ms.fp.page;
+	u32 end = ms.rec ? ms.tpos : ms.wpos;
+	u32 newrec = 0;
+	u32 dst;
+	u32 rec;
+
+	if (!ms.full && ((PAGE_START + live_size()) == end)) {
+		// no dead records
+		return -1;
+	}
+	dst = fpair_xfer_begin(&ms.fp);
+	if (!dst) {
+		return -1;
+	}
+	for (rec = PAGE_START; rec < ms.wpos; rec = rec_next(rec)) {
+		if (FLASH16(rec) != MREC_LIVE) continue;
+		if (copy16(dst, rec, rec_next(rec) - rec)) {
+			return -1;
+		}
+		dst += rec_next(rec) - rec;
+	}
+	if (ms.rec) {
+		// status and text so far; the length is programmed at the end, as usual
+		if (flash_prog16(dst, MREC_LIVE) ||
+			copy16(dst + MREC_HDR, ms.rec + MREC_HDR, ms.tpos - ms.rec - MREC_HDR)) {
+			return -1;
+		}
+		newrec = dst;
+	}
+	if (fpair_xfer_end(&ms.fp) && (ms.fp.page == oldpage)) {
+		return -1;
+	}
+	if (newrec) {
+		ms.tpos = newrec + (ms.tpos - ms.rec);
+		ms.rec = newrec;
+	}
+	ms.wpos = dst;
+	ms.full = 0;
+	return 0;
+}
+
+static int put_byte(u8 c) {
+	if (((ms.tpos + 2) > PAGE_END) && (compact() || ((ms.tpos + 2) > PAGE_END))) {
+		return -1;
+	}
+	if (ms.odd < 0) {
+		ms.odd = c;
+		ms.tlen++;
+		return 0;
+	}
+	if (flash_prog16(ms.tpos, (u16) ms.odd | (c << 8))) {
+		return -1;
+	}
+	ms.tpos += 2;
+	ms.odd = -1;
+	ms.tlen++;
+	return 0;
+}
+
+/** close current record */
+static void rec_finish(u16 status) {
+	if (ms.odd >= 0) {
+		flash_prog16(ms.tpos, (u16) ms.odd | 0xFF00);
+		ms.tpos += 2;
+		ms.odd = -1;
+	}
+	flash_prog16(ms.rec + 2, ms.tlen);
+	if (status == MREC_DEAD) {
+		flash_prog16(ms.rec, MREC_DEAD);
+	}
+	ms.wpos = ms.tpos;
+	ms.rec = 0;
+}
+
+int macro_begin(const char *name, unsigned namelen) {
+	if (ms.rec || !namelen || (namelen > MACRO_NAMEMAX) ||
+		memchr(name, '\n', namelen)) {
+		return -1;
+	}
+	if ((ms.full || ((ms.wpos + MREC_HDR + namelen + 2) > PAGE_END)) &&
+		(compact() || ((ms.wpos + MREC_HDR + namelen + 2) > PAGE_END))) {
+		return -1;
+	}
+	if (flash_prog16(ms.wpos, MREC_LIVE)) {
+		return -1;
+	}
+	ms.rec = ms.wpos;
+	ms.tpos = ms.wpos + MREC_HDR;
+	ms.tlen = 0;
+	ms.odd = -1;
+	return macro_append((const u8 *) name, namelen, 1);
+}
+
+int macro_append(const uint8_t *data, unsigned len, bool eol) {
+	if (!ms.rec) {
+		return -1;
+	}
+	while (len--) {
+		if (put_byte(*data++)) {
+			goto fail;
+		}
+	}
+	if (eol && put_byte('\n')) {
+		goto fail;
+	}
+	return 0;
+fail:
+	rec_finish(MREC_DEAD);
+	return -1;
+}
+
+int macro_end(void) {
+	u32 newrec = ms.rec;
+	u32 rec;
+
+	if (!newrec) {
+		return -1;
+	}
+	rec_finish(MREC_LIVE);
+
+	unsigned namelen = rec_namelen(newrec);
+	for (rec = PAGE_START; rec < newrec; rec = rec_next(rec)) {
+		if (rec_match(rec, rec_text(newrec), namelen)) {
+			flash_prog16(rec, MREC_DEAD);
+		}
+	}
+	return 0;
+}
+
+void macro_cancel(void) {
+	if (ms.rec) {
+		rec_finish(MREC_DEAD);
+	}
+}
+
+const char *macro_find(const char *name, unsigned namelen, unsigned *len) {
+	u32 rec;
+
+	for (rec = PAGE_START; rec < ms.wpos; rec = rec_next(rec)) {
+		if (rec_match(rec, name, namelen)) {
+			*len = FLASH16(rec + 2) - namelen - 1;
+			return rec_text(rec) + namelen + 1;
+		}
+	}
+	return NULL;
+}
+
+int macro_delete(const char *name, unsigned namelen) {
+	u32 rec;
+
+	for (rec = PAGE_START; rec < ms.wpos; rec = rec_next(rec)) {
+		if (rec_match(rec, name, namelen)) {
+			return flash_prog16(rec, MREC_DEAD);
+		}
+	}
+	return -1;
+}
+
+void macro_erase_all(void) {
+	fpair_clear(&ms.fp);
+	scan_page();
+}
+
+void macro_walk(void (*cb)(const char *name, unsigned namelen, unsigned bodylen)) {
+	u32 rec;
+
+	for (rec = PAGE_START; rec < ms.wpos; rec = rec_next(rec)) {
+		if (FLASH16(rec) != MREC_LIVE) continue;
+		unsigned namelen = rec_namelen(rec);
+		cb(rec_text(rec), namelen, FLASH16(rec + 2) - namelen - 1);
+	}
+}
+
+unsigned macro_free(void) {
+	return PAGE_END - PAGE_START - live_size();
+}
@@ -0,0 +1,73 @@
+#ifndef _MACRO_STORE_H
+#define _MACRO_STORE_H
+
+/*
+ * Command macros, stored in flash
+ *
+ * (c) fenugrec 2018-2021
+ * GPLv3
+ *
+ * A macro is a name and a list of lines (commands or data), kept as text.
+ * Definitions are appended to the page while they are received; redefining
+ * or deleting a macro only marks the old record dead. When the page is full,
+ * live macros are copied to a second page, which becomes active.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cfg_store.h"
+
+/* two pages just below the config store; the linker script must keep code out of there. */
+#define MACRO_PAGESIZE	1024
+#define MACRO_BASE	(CFG_BASE - (2 * MACRO_PAGESIZE))
+
+#define MACRO_NAMEMAX	15
+
+
+/** find end of log. Must be called before the other macro_*() functions */
+void macro_store_init(void);
+
+/** start recording a new macro
+ * @return 0 if ok
+ */
+int macro_begin(const char *name, unsigned namelen);
+
+/** check if a macro is being recorded */
+bool macro_recording(void);
+
+/** add bytes to the macro being recorded
+ * @param eol terminate the line after these bytes
+ * @return 0 if ok; on error (page full), recording is cancelled.
+ */
+int macro_append(const uint8_t *data, unsigned len, bool eol);
+
+/** finish recording; replaces any older macro with the same name
+ * @return 0 if ok
+ */
+int macro_end(void);
+
+/** drop macro being recorded, if any */
+void macro_cancel(void);
+
+/** find macro
+ * @param len (output) length of body
+ * @return body, i.e. '\n'-terminated lines, or NULL if not found
+ */
+const char *macro_find(const char *name, unsigned namelen, unsigned *len);
+
+/** delete macro
+ * @return 0 if ok
+ */
+int macro_delete(const char *name, unsigned namelen);
+
+/** erase all macros */
+void macro_erase_all(void);
+
+/** call cb for every macro */
+void macro_walk(void (*cb)(const char *name, unsigned namelen, unsigned bodylen));
+
+/** @return bytes left in page, including what compaction would reclaim */
+unsigned macro_free(void);
+
+#endif // _MACRO_STORE_H
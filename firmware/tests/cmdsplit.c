@@ -0,0 +1,110 @@
+/* test suite for ";++" command batch splitting (cmd_batch.c)
+ * (c) fenugrec 2018-2021
+ *
+ * This is meant to be compiled and run on the host system, not the mcu !
+ *
+ * Lines are given as the input filter stores them, i.e. with the escapes
+ * kept in front of ';' and Escape; they are split like chunk_cmdline() does.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cmd_batch.h"
+
+#define MAXCMDS 6
+
+struct tvect {
+	const char *name;
+	const char *input;
+	bool batch;
+	const char *cmds[MAXCMDS];    //expected commands, NULL-terminated
+};
+
+static const struct tvect vectors[] = {
+	{"single", "++addr 5", 0, {"++addr 5", NULL}},
+	{"batch", "++addr 5;++eos 3;++read eoi", 1, {"++addr 5", "++eos 3", "++read eoi", NULL}},
+	{"scpi", "++tmo 3;*RST;*CLS", 0, {"++tmo 3;*RST;*CLS", NULL}},
+	{"esc_semi", "++x a\x1b;++b", 0, {"++x a;++b", NULL}},
+	{"esc_semi_batch", "++x a\x1b;++b;++c", 1, {"++x a;++b", "++c", NULL}},
+	{"esc_esc", "++a\x1b\x1b;++b", 1, {"++a\x1b", "++b", NULL}},
+	{"trailing_sep", "++addr 5;++", 1, {"++addr 5", "++", NULL}},
+	{"trailing_semi", "++addr 5;", 0, {"++addr 5;", NULL}},
+	{"partial_sep", "++addr 5;+", 0, {"++addr 5;+", NULL}},
+	{"empty_mid", "++a;++;++b", 1, {"++a", "++", "++b", NULL}},
+	{"empty_lead", ";++a", 1, {"", "++a", NULL}},
+	{"double_sep", "++a;++;++", 1, {"++a", "++", "++", NULL}},
+	{NULL, NULL, 0, {NULL}}
+};
+
+
+/** ret 1 if ok */
+static bool run_test(const struct tvect *tv) {
+	char buf[128];
+	char *line = buf;
+	unsigned len = strlen(tv->input);
+	unsigned idx = 0;
+
+	memcpy(buf, tv->input, len + 1);
+
+	if (!find_cmdsep(line, len)) {
+		if (tv->batch) {
+			printf("FAIL\tnot split\t");
+			return 0;
+		}
+		len = cmd_unescape(line, len);
+		if ((len != strlen(tv->cmds[0])) || strcmp(line, tv->cmds[0])) {
+			printf("FAIL\tgot \"%s\"\t", line);
+			return 0;
+		}
+		printf("PASS\t");
+		return 1;
+	}
+	if (!tv->batch) {
+		printf("FAIL\tsplit\t");
+		return 0;
+	}
+	while (line) {
+		char *cmd = line;
+		unsigned clen = cmd_split(&line, &len);
+
+		if (!tv->cmds[idx]) {
+			printf("FAIL\textra command \"%s\"\t", cmd);
+			return 0;
+		}
+		if ((clen != strlen(tv->cmds[idx])) || strcmp(cmd, tv->cmds[idx])) {
+			printf("FAIL\tcommand %u: got \"%s\"\t", idx, cmd);
+			return 0;
+		}
+		if (line && (len != strlen(line))) {
+			printf("FAIL\tbad remaining length %u\t", len);
+			return 0;
+		}
+		idx++;
+	}
+	if (tv->cmds[idx]) {
+		printf("FAIL\tmissing \"%s\"\t", tv->cmds[idx]);
+		return 0;
+	}
+	printf("PASS\t");
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	(void) argc;
+	(void) argv;
+	unsigned icur;
+	unsigned fails = 0;
+
+	printf("RESULT\tdetail\t\t(pattern)\n");
+
+	for (icur = 0; vectors[icur].input; icur++) {
+		if (!run_test(&vectors[icur])) {
+			fails++;
+		}
+		printf("(%s)\n", vectors[icur].name);
+	}
+
+	return fails ? 1 : 0;
+}
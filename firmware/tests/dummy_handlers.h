@@ -34,8 +34,26 @@ void do_savecfg(const char *args) {(void) args;}
 void do_spoll(const char *args) {(void) args;}
 void do_srq(const char *args) {(void) args;}
 void do_status(const char *args) {(void) args;}
+void do_devq(const char *args) {(void) args;}
+void do_devsel(const char *args) {(void) args;}
+void do_dcache(const char *args) {(void) args;}
 void do_trg(const char *args) {(void) args;}
 void do_help(const char *args) {(void) args;}
+void do_reset_dfu(const char *args) {(void) args;}
+void do_binmode(const char *args) {(void) args;}
+void do_query(const char *args) {(void) args;}
+void do_mquery(const char *args) {(void) args;}
+void do_scan(const char *args) {(void) args;}
+void do_tseq(const char *args) {(void) args;}
+void do_cfg(const char *args) {(void) args;}
+void do_abort_ifc(const char *args) {(void) args;}
+void do_rframe(const char *args) {(void) args;}
+void do_tag(const char *args) {(void) args;}
+void do_waitsrq(const char *args) {(void) args;}
+void do_mdef(const char *args) {(void) args;}
+void do_run(const char *args) {(void) args;}
+void do_mlist(const char *args) {(void) args;}
+void do_mdel(const char *args) {(void) args;}
 // *INDENT-ON*
 
 #endif
@@ -0,0 +1,328 @@
+/* test suite for host input filtering and chunk building (host_comms.c)
+ * (c) fenugrec 2018-2021
+ *
+ * This is meant to be compiled and run on the host system, not the mcu !
+ *
+ * The real host_comms.c is compiled in; input is fed as USB packets, like
+ * usb_cdc.c does, and the chunks are checked as cmd_poll() would see them.
+ * Every input stream is fed with all packet sizes, and after a few stray
+ * CR/LF to shift it, so delimiters land at every offset and alignment.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_comms.h"
+#include "hw_backend.h"
+
+
+/****** what host_comms.c needs from the rest of the firmware */
+uint32_t pc;    //get_pc() refers to a "pc" symbol when assembled for x86
+unsigned ovf_count;
+
+void sys_incstats(enum stats_type stat) {
+	(void) stat;
+	ovf_count++;
+}
+void assert_failed(void) {
+	printf("FAIL\tassert\n");
+	exit(1);
+}
+void assert_failed_v(int reason) {
+	printf("FAIL\tassert %x\n", reason);
+	exit(1);
+}
+uint32_t get_ms(void) {
+	return 0;
+}
+int snprintf_(char *s, size_t n, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int rv = vsnprintf(s, n, fmt, ap);
+	va_end(ap);
+	return rv;
+}
+/*************************/
+
+#define MAXCHUNKS 8
+
+struct tchunk {
+	enum chunk_type type;
+	const char *data;
+	unsigned len;   //if 0, determined by 0-termination
+	uint8_t flags;
+};
+
+struct tvect {
+	const char *name;
+	const char *input;
+	unsigned input_len; //if 0, input len will be determined by 0-termination
+	struct tchunk out[MAXCHUNKS];  //expected chunks, terminated by data == NULL
+};
+
+static const struct tvect vectors[] = {
+	{"plain", "++addr 5\n1234\r\n*IDN?\r", 0, {
+		 {CHUNK_CMD, "++addr 5", 0, 0},
+		 {CHUNK_DATA, "1234", 0, 0},
+		 {CHUNK_DATA, "*IDN?", 0, 0},
+		 {0, NULL, 0, 0}}},
+	{"longruns", "0123456789abcdefghijklmnopqrstuvwxyz0123456789\n++a\r\n", 0, {
+		 {CHUNK_DATA, "0123456789abcdefghijklmnopqrstuvwxyz0123456789", 0, 0},
+		 {CHUNK_CMD, "++a", 0, 0},
+		 {0, NULL, 0, 0}}},
+	{"escapes", "12\x1b\r34\x1b\n5\x1b\x1b\n\x1b+x\n", 0, {
+		 {CHUNK_DATA, "12\r34\n5\x1b", 0, 0},
+		 {CHUNK_DATA, "+x", 0, 0},  //escaped '+' : data
+		 {0, NULL, 0, 0}}},
+	{"binary", "a\x00\x80\xff\x1b\x00z\n", 8, {
+		 {CHUNK_DATA, "a\x00\x80\xff\x00z", 6, 0},
+		 {0, NULL, 0, 0}}},
+	{"cmd_esc", "++x A\x1b\nB\n", 0, {
+		 {CHUNK_CMD, "++x A\nB", 0, 0},
+		 {0, NULL, 0, 0}}},
+	{"cmd_semi", "++a\x1b;++b\x1b\x1b;c\nd\x1b;e\n", 0, {
+		 {CHUNK_CMD, "++a\x1b;++b\x1b\x1b;c", 0, 0},  //escapes kept for cmd_unescape()
+		 {CHUNK_DATA, "d;e", 0, 0},
+		 {0, NULL, 0, 0}}},
+	{NULL, NULL, 0, {{0, NULL, 0, 0}}}
+};
+
+
+/** queue up to pktsize bytes as one packet, and filter
+ * @return bytes queued */
+static unsigned feed_packet(const uint8_t *src, unsigned len, unsigned pktsize) {
+	struct rx_packet *pkt = host_rx_pkt_alloc();
+
+	if (!pkt) {
+		return 0;
+	}
+	if (len > pktsize) {
+		len = pktsize;
+	}
+	memcpy(pkt->data, src, len);
+	pkt->len = len;
+	host_rx_pkt_queue();
+	host_comms_poll();
+	return len;
+}
+
+static void feed(const uint8_t *src, unsigned len, unsigned pktsize) {
+	while (len) {
+		unsigned done = feed_packet(src, len, pktsize);
+		if (!done) {
+			printf("FAIL\tpacket queue full\t");
+			return;
+		}
+		src += done;
+		len -= done;
+	}
+}
+
+/** compare next chunk
+ * @return 1 if ok */
+static bool check_chunk(const struct tchunk *tc) {
+	struct rx_chunk chunk;
+	uint8_t buf[HOST_IN_BUFSIZE];
+	unsigned tlen = tc->len ? tc->len : strlen(tc->data);
+
+	// like the main loop : resume filtering input that was waiting for ring space
+	host_comms_poll();
+	if (!host_rx_getchunk(&chunk)) {
+		printf("FAIL\tmissing chunk \"%s\"\t", tc->data);
+		return 0;
+	}
+	unsigned len = chunk.len[0] + chunk.len[1];
+	memcpy(buf, chunk.data[0], chunk.len[0]);
+	memcpy(&buf[chunk.len[0]], chunk.data[1], chunk.len[1]);
+	host_rx_release();
+
+	if ((chunk.type != tc->type) || (chunk.flags != tc->flags)) {
+		printf("FAIL\ttype/flags %u/%u, want %u/%u\t", chunk.type, chunk.flags, tc->type, tc->flags);
+		return 0;
+	}
+	if ((len != tlen) || memcmp(buf, tc->data, tlen)) {
+		printf("FAIL\tgot \"%.*s\", want \"%s\"\t", len, buf, tc->data);
+		return 0;
+	}
+	if (((chunk.type == CHUNK_CMD) || ((chunk.type == CHUNK_FRAME) && (chunk.hdr.type == FT_CMD))) &&
+		(chunk.len[1] || chunk.data[0][len])) {
+		printf("FAIL\tcommand not contiguous / 0-terminated\t");
+		return 0;
+	}
+	return 1;
+}
+
+/** ret 1 if ok */
+static bool run_test(const struct tvect *tv) {
+	unsigned ilen = tv->input_len ? tv->input_len : strlen(tv->input);
+	unsigned pktsize, shift, idx;
+	uint8_t buf[256];
+
+	for (shift = 0; shift < 4; shift++) {
+		// stray CR/LF never make chunks, but move everything after them
+		memset(buf, '\r', shift);
+		memcpy(&buf[shift], tv->input, ilen);
+		for (pktsize = 1; pktsize <= HOST_RX_PKTSIZE; pktsize++) {
+			host_comms_init();
+			feed(buf, shift + ilen, pktsize);
+			for (idx = 0; tv->out[idx].data; idx++) {
+				if (!check_chunk(&tv->out[idx])) {
+					printf("(shift %u, pktsize %u)\t", shift, pktsize);
+					return 0;
+				}
+			}
+			struct rx_chunk extra;
+			if (host_rx_getchunk(&extra)) {
+				printf("FAIL\textra chunk (shift %u, pktsize %u)\t", shift, pktsize);
+				return 0;
+			}
+		}
+	}
+	printf("PASS\t");
+	return 1;
+}
+
+/** Escape as the last byte of a packet applies to the first byte of the next */
+static bool test_esc_split(void) {
+	static const struct tchunk want = {CHUNK_DATA, "ab\ncd", 0, 0};
+
+	host_comms_init();
+	feed((const uint8_t *) "ab\x1b", 3, HOST_RX_PKTSIZE);
+	feed((const uint8_t *) "\ncd\n", 4, HOST_RX_PKTSIZE);
+	if (!check_chunk(&want)) {
+		return 0;
+	}
+	printf("PASS\t");
+	return 1;
+}
+
+/** line longer than the input ring : dropped up to the next unescaped CR/LF,
+ * and the following chunk is flagged. */
+static bool test_resync(void) {
+	static const struct tchunk want[] = {
+		{CHUNK_CMD, "++ok", 0, CHUNK_F_OVERFLOW},
+		{CHUNK_DATA, "next", 0, 0},
+	};
+	uint8_t line[HOST_IN_BUFSIZE + 10];
+	unsigned idx;
+
+	host_comms_init();
+	ovf_count = 0;
+	memset(line, 'x', sizeof(line));
+	feed(line, sizeof(line), HOST_RX_PKTSIZE);
+	// still resyncing : escaped CR/LF don't count, the bytes up to the real LF are dropped too
+	feed((const uint8_t *) "yy\x1b\nzz\x1b\r\n", 9, 7);
+	feed((const uint8_t *) "++ok\nnext\n", 10, HOST_RX_PKTSIZE);
+	for (idx = 0; idx < 2; idx++) {
+		if (!check_chunk(&want[idx])) {
+			return 0;
+		}
+	}
+	if (!ovf_count) {
+		printf("FAIL\toverflow not counted\t");
+		return 0;
+	}
+	printf("PASS\t");
+	return 1;
+}
+
+/** commands are parsed in place : they must never wrap around the end of the ring,
+ * wherever the previous chunk ends, and whether it was released or not.
+ * Same for FT_CMD frames.
+ */
+static bool test_cmd_wrap(void) {
+	char cmd[150];
+	char data[HOST_IN_BUFSIZE];
+	struct tchunk want_data = {CHUNK_DATA, data, 0, 0};
+	struct tchunk want_cmd = {CHUNK_CMD, cmd, 0, 0};
+	unsigned dlen, held;
+
+	// like a long "++mquery" list
+	memset(cmd, '5', sizeof(cmd));
+	memcpy(cmd, "++mquery ", 9);
+	cmd[sizeof(cmd) - 1] = 0;
+
+	for (dlen = 1; dlen < (HOST_IN_BUFSIZE - 2); dlen++) {
+		for (held = 0; held < 2; held++) {
+			host_comms_init();
+			ovf_count = 0;
+			memset(data, 'd', dlen);
+			data[dlen] = '\n';
+			feed((const uint8_t *) data, dlen + 1, HOST_RX_PKTSIZE);
+			data[dlen] = 0;
+			if (!held && !check_chunk(&want_data)) {
+				return 0;
+			}
+			cmd[sizeof(cmd) - 1] = '\n';
+			feed((const uint8_t *) cmd, sizeof(cmd), HOST_RX_PKTSIZE);
+			cmd[sizeof(cmd) - 1] = 0;
+			if ((held && !check_chunk(&want_data)) || !check_chunk(&want_cmd)) {
+				printf("(data %u, held %u)\t", dlen, held);
+				return 0;
+			}
+			if (ovf_count) {
+				printf("FAIL\tdropped (data %u, held %u)\t", dlen, held);
+				return 0;
+			}
+		}
+	}
+
+	// framed mode : FT_WRITE payload, then FT_CMD
+	for (dlen = 1; dlen < FRAME_MAXLEN; dlen++) {
+		struct frame_hdr hdr = {FRAME_SYNC, FT_WRITE, 0, FRAME_ADDR_DEFAULT, 0, {dlen & 0xFF, dlen >> 8}};
+		unsigned clen = sizeof(cmd) - 1;
+		struct rx_chunk chunk;
+
+		host_comms_init();
+		host_set_framed(1);
+		ovf_count = 0;
+		memset(data, 'd', dlen);
+		feed((const uint8_t *) &hdr, sizeof(hdr), HOST_RX_PKTSIZE);
+		feed((const uint8_t *) data, dlen, HOST_RX_PKTSIZE);
+		if (!host_rx_getchunk(&chunk)) {
+			printf("FAIL\tmissing FT_WRITE\t");
+			return 0;
+		}
+		host_rx_release();
+		hdr.type = FT_CMD;
+		hdr.len[0] = clen & 0xFF;
+		hdr.len[1] = clen >> 8;
+		feed((const uint8_t *) &hdr, sizeof(hdr), HOST_RX_PKTSIZE);
+		feed((const uint8_t *) cmd, clen, HOST_RX_PKTSIZE);
+		want_cmd.type = CHUNK_FRAME;
+		if (!check_chunk(&want_cmd) || ovf_count) {
+			printf("(FT_CMD after %u)\t", dlen);
+			return 0;
+		}
+	}
+	printf("PASS\t");
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	(void) argc;
+	(void) argv;
+	unsigned icur;
+	unsigned fails = 0;
+
+	printf("RESULT\tdetail\t\t(pattern)\n");
+
+	for (icur = 0; vectors[icur].input; icur++) {
+		if (!run_test(&vectors[icur])) {
+			fails++;
+		}
+		printf("(%s)\n", vectors[icur].name);
+	}
+	fails += !test_esc_split();
+	printf("(esc_split)\n");
+	fails += !test_resync();
+	printf("(resync)\n");
+	fails += !test_cmd_wrap();
+	printf("(cmd_wrap)\n");
+
+	return fails ? 1 : 0;
+}
@@ -23,11 +23,14 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/cdc.h>
 
+#include "cmd_parser.h"
 #include "host_comms.h"
+#include "hw_backend.h"
 #include "ecbuff.h"
 #include "stypes.h"
 #include "usb_cdc.h"
@@ -37,13 +40,26 @@
 static struct {
 	bool vcp_avail; //don't send BULK_OUT packets until enumerated and host is doing ACM/VCP stuff
 	bool usbwrite_busy; //set to 1 after writing a packet to the EP, cleared in callback
-} usb_stuff = {0};
+	bool rx_nak;    //OUT EP is NAKed because the packet ring is full
+	bool dtr;   //last DTR state set by host
+	struct usb_cdc_line_coding line_coding; //ignored, but must be read back (ACM D1)
+} usb_stuff = {
+	.line_coding = {
+		.dwDTERate = 115200,
+		.bCharFormat = USB_CDC_1_STOP_BITS,
+		.bParityType = USB_CDC_NO_PARITY,
+		.bDataBits = 8,
+	},
+};
 
 
 #define COMM_IN_EP		0x83
 #define DATA_IN_EP		0x82
 #define DATA_OUT_EP		0x01
 #define BULK_EP_MAXSIZE 64
+#if (BULK_EP_MAXSIZE != HOST_RX_PKTSIZE)
+#error packet ring size mismatch
+#endif
 
 #define USB_VID 0x1d50 //openmoko
 #define USB_PID 0x0488 //unused PID so far. 488 as in "ISO 488" !
@@ -123,7 +139,9 @@ static const struct {
 		.bFunctionLength = sizeof(struct usb_cdc_acm_descriptor),
 		.bDescriptorType = CS_INTERFACE,
 		.bDescriptorSubtype = USB_CDC_TYPE_ACM,
-		.bmCapabilities = 0,
+		// D1 : line coding and SET_CONTROL_LINE_STATE, D2 : SEND_BREAK.
+		// Hosts only send a break if D2 is set.
+		.bmCapabilities = (1 << 1) | (1 << 2),
 	},
 	.cdc_union = {
 		.bFunctionLength = sizeof(struct usb_cdc_union_descriptor),
@@ -209,40 +227,83 @@ static enum usbd_request_return_codes cdcacm_control_request(usbd_device *usbd_d
 															 void (**complete)(usbd_device *usbd_dev, struct usb_setup_data *req))
 {
 	(void)complete;
-	(void)buf;
 	(void)usbd_dev;
 
 	switch (req->bRequest) {
 	case USB_CDC_REQ_SET_CONTROL_LINE_STATE: {
 		/*
 		 * This Linux cdc_acm driver requires this to be implemented
-		 * even though it's optional in the CDC spec, and we don't
-		 * advertise it in the ACM functional descriptor.
+		 * even though it's optional in the CDC spec. DTR drops are
+		 * used to detect a closed port.
 		 */
+		bool dtr = req->wValue & 1;
+		if (usb_stuff.dtr && !dtr) {
+			// host closed the port. Only trust DTR if it was set at some point,
+			// some hosts never touch it.
+			usb_stuff.vcp_avail = 0;
+			host_abort_request(ABORT_CLOSED);
+		} else if (dtr) {
+			usb_stuff.vcp_avail = 1;
+		}
+		usb_stuff.dtr = dtr;
 		return USBD_REQ_HANDLED;
 	}
+	case USB_CDC_REQ_SEND_BREAK:
+		// any break (wValue = duration) aborts the current operation
+		if (req->wValue) {
+			host_abort_request(ABORT_BREAK);
+		}
+		return USBD_REQ_HANDLED;
 	case USB_CDC_REQ_SET_LINE_CODING:
 		usb_stuff.vcp_avail = 1;
 		if (*len < sizeof(struct usb_cdc_line_coding)) {
 			return USBD_REQ_NOTSUPP;
 		}
-
+		memcpy(&usb_stuff.line_coding, *buf, sizeof(struct usb_cdc_line_coding));
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_GET_LINE_CODING:
+		*buf = (uint8_t *) &usb_stuff.line_coding;
+		if (*len > sizeof(struct usb_cdc_line_coding)) {
+			*len = sizeof(struct usb_cdc_line_coding);
+		}
 		return USBD_REQ_HANDLED;
 	}
 	return USBD_REQ_NOTSUPP;
 }
 
+/** vendor requests : config / status side channel, see cmd_parser.h */
+static enum usbd_request_return_codes vendor_control_request(usbd_device *usbd_dev,
+															 struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
+															 void (**complete)(usbd_device *usbd_dev, struct usb_setup_data *req))
+{
+	(void)complete;
+	(void)usbd_dev;
+
+	if (cmd_vendor_request(req->bRequest, req->wValue, *buf, len)) {
+		return USBD_REQ_NOTSUPP;
+	}
+	return USBD_REQ_HANDLED;
+}
+
 static void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 {
 	(void)ep;
 
-	u8 buf[BULK_EP_MAXSIZE];
-	unsigned len = usbd_ep_read_packet(usbd_dev, DATA_OUT_EP, buf, BULK_EP_MAXSIZE);
-
-	unsigned cnt;
-	for (cnt = 0; cnt < len; cnt++) {
-		host_comms_rx(buf[cnt]);
+	struct rx_packet *pkt = host_rx_pkt_alloc();
+	if (!pkt) {
+		//shouldn't happen since the EP is NAKed before filling the last slot
+		u8 buf[BULK_EP_MAXSIZE];
+		usbd_ep_read_packet(usbd_dev, DATA_OUT_EP, buf, BULK_EP_MAXSIZE);
+		sys_incstats(STATS_RXOVF);
+		return;
+	}
+	if (host_rx_pkt_free() == 1) {
+		//taking the last slot : must be set before reading, to keep the EP from being re-enabled
+		usbd_ep_nak_set(usbd_dev, DATA_OUT_EP, 1);
+		usb_stuff.rx_nak = 1;
 	}
+	pkt->len = usbd_ep_read_packet(usbd_dev, DATA_OUT_EP, pkt->data, BULK_EP_MAXSIZE);
+	host_rx_pkt_queue();
 }
 
 /** drain fifo and send usb packet. return #bytes copied
@@ -292,15 +353,26 @@ static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
 		USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
 		USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
 		cdcacm_control_request);
+	usbd_register_control_callback(
+		usbd_dev,
+		USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+		USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+		vendor_control_request);
 }
 
 
 /** called every SOF (1ms)
  *
  * Just registering this callback should enable the interrupt ?
- * check if we have any data to send to host.
+ * check if we have any data to send to host,
+ * and resume reception if the main loop freed some packet slots.
 */
 static void usbsof_cb(void) {
+	if (usb_stuff.rx_nak && (host_rx_pkt_free() > 1)) {
+		usb_stuff.rx_nak = 0;
+		usbd_ep_nak_set(usbd_dev_private, DATA_OUT_EP, 0);
+	}
+
 	if (!usb_stuff.vcp_avail) {
 		//if not enumerated yet, don't send stuff
 		return;
@@ -320,6 +392,10 @@ void usb_isr (void) {
 
 
 /**** public funcs */
+bool fwusb_host_avail(void) {
+	return usb_stuff.vcp_avail;
+}
+
 void fwusb_init(void) {
 	usbd_dev_private = usbd_init(&st_usbfs_v2_usb_driver, &dev, &config,
 								 usb_strings, USB_NUM_STRINGS,
@@ -1,7 +1,15 @@
 #ifndef USB_CDC_H
 #define USB_CDC_H
 
+#include <stdbool.h>
+
 /** Init & start USB */
 void fwusb_init(void);
 
+/** check if a host has the port open
+ *
+ * i.e. after it sets the line coding, and until it drops DTR.
+ */
+bool fwusb_host_avail(void);
+
 #endif